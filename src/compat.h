@@ -89,6 +89,15 @@ typedef u_int SOCKET;
 #define THREAD_PRIORITY_ABOVE_NORMAL    (-2)
 #endif
 
+// poll() has no FD_SETSIZE limit on the descriptors it can watch, epoll
+// additionally keeps the interest set in the kernel between calls
+#ifndef WIN32
+#define USE_POLL
+#endif
+#if defined(__linux__)
+#define USE_EPOLL
+#endif
+
 #if HAVE_DECL_STRNLEN == 0
 size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
@@ -12,10 +12,17 @@
 #include "primitives/block.h"
 #include "uint256.h"
 
-uint256 ComputeMerkleRoot(const std::vector<uint256>& leaves, bool* mutated = NULL);
+uint256 ComputeMerkleRoot(std::vector<uint256> hashes, bool* mutated = NULL);
 std::vector<uint256> ComputeMerkleBranch(const std::vector<uint256>& leaves, uint32_t position);
 uint256 ComputeMerkleRootFromBranch(const uint256& leaf, const std::vector<uint256>& branch, uint32_t position);
 
+/*
+ * Compute all levels of the Merkle tree over leaves, bottom up, into a single
+ * buffer. Level h starts at tree[levels[h]]; levels below the top are padded
+ * with a copy of their last entry when they have an odd size.
+ */
+void ComputeMerkleTree(const std::vector<uint256>& leaves, std::vector<uint256>& tree, std::vector<size_t>& levels);
+
 /*
  * Compute the Merkle root of the transactions in a block.
  * *mutated is set to true if a duplicated subtree was found.
@@ -44,6 +44,28 @@
  * @return 0 if the key is generated correctly; -1 if there is an error (usually due to lack of memory for allocation)
  */
 int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *salt, uint64_t saltlen, uint64_t timeCost, uint64_t nRows, uint64_t nCols) {
+    //Tries to allocate enough space for the whole memory matrix
+    uint64_t *wholeMatrix = malloc(nRows * BLOCK_LEN_BYTES * nCols);
+    if (wholeMatrix == NULL) {
+      return -1;
+    }
+
+    int ret = LYRA2_matrix(K, kLen, pwd, pwdlen, salt, saltlen, timeCost, nRows, nCols, wholeMatrix);
+
+    free(wholeMatrix);
+    return ret;
+}
+
+/**
+ * Same as LYRA2, but uses the caller-provided memory matrix instead of allocating one,
+ * so that it can be called repeatedly (e.g., for every block header) without touching
+ * the heap. The matrix does not need to be initialized nor aligned.
+ *
+ * @param wholeMatrix Scratch space of at least nRows * nCols * BLOCK_LEN_BYTES bytes
+ *
+ * @return 0 if the key is generated correctly; -1 if the parameters do not fit the matrix
+ */
+int LYRA2_matrix(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *salt, uint64_t saltlen, uint64_t timeCost, uint64_t nRows, uint64_t nCols, uint64_t *wholeMatrix) {
 
     //============================= Basic variables ============================//
     int64_t row = 2; //index of row to be processed
@@ -54,33 +76,13 @@ int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *
     int64_t window = 2; //Visitation window (used to define which rows can be revisited during Setup)
     int64_t gap = 1; //Modifier to the step, assuming the values 1 or -1
     int64_t i; //auxiliary iteration counter
+    const spongeImpl *sp = lyra2Sponge; //sponge implementation in use
     //==========================================================================/
 
-    //========== Initializing the Memory Matrix and pointers to it =============//
-    //Tries to allocate enough space for the whole memory matrix
-
-
+    //========== Pointers to the rows of the Memory Matrix =====================//
+    //Every row is written before it is read, so the matrix is not cleared here
     const int64_t ROW_LEN_INT64 = BLOCK_LEN_INT64 * nCols;
-    const int64_t ROW_LEN_BYTES = ROW_LEN_INT64 * 8;
-
-    i = (int64_t) ((int64_t) nRows * (int64_t) ROW_LEN_BYTES);
-    uint64_t *wholeMatrix = malloc(i);
-    if (wholeMatrix == NULL) {
-      return -1;
-    }
-    memset(wholeMatrix, 0, i);
-
-    //Allocates pointers to each row of the matrix
-    uint64_t **memMatrix = malloc(nRows * sizeof (uint64_t*));
-    if (memMatrix == NULL) {
-      return -1;
-    }
-    //Places the pointers in the correct positions
-    uint64_t *ptrWord = wholeMatrix;
-    for (i = 0; i < nRows; i++) {
-      memMatrix[i] = ptrWord;
-      ptrWord += ROW_LEN_INT64;
-    }
+#define MEM_MATRIX(r) (wholeMatrix + (r) * ROW_LEN_INT64)
     //==========================================================================/
 
     //============= Getting the password + salt + basil padded with 10*1 ===============//
@@ -89,6 +91,9 @@ int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *
 
     //First, we clean enough blocks for the password, salt, basil and padding
     uint64_t nBlocksInput = ((saltlen + pwdlen + 6 * sizeof (uint64_t)) / BLOCK_LEN_BLAKE2_SAFE_BYTES) + 1;
+    if (nBlocksInput * BLOCK_LEN_BLAKE2_SAFE_BYTES > nRows * ROW_LEN_INT64 * 8) {
+      return -1;
+    }
     byte *ptrByte = (byte*) wholeMatrix;
     memset(ptrByte, 0, nBlocksInput * BLOCK_LEN_BLAKE2_SAFE_BYTES);
 
@@ -123,28 +128,25 @@ int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *
 
     //======================= Initializing the Sponge State ====================//
     //Sponge state: 16 uint64_t, BLOCK_LEN_INT64 words of them for the bitrate (b) and the remainder for the capacity (c)
-    uint64_t *state = malloc(16 * sizeof (uint64_t));
-    if (state == NULL) {
-      return -1;
-    }
+    uint64_t state[16] ALIGN;
     initState(state);
     //==========================================================================/
 
     //================================ Setup Phase =============================//
     //Absorbing salt, password and basil: this is the only place in which the block length is hard-coded to 512 bits
-    ptrWord = wholeMatrix;
+    uint64_t *ptrWord = wholeMatrix;
     for (i = 0; i < nBlocksInput; i++) {
-      absorbBlockBlake2Safe(state, ptrWord); //absorbs each block of pad(pwd || salt || basil)
+      sp->absorbBlockBlake2Safe(state, ptrWord); //absorbs each block of pad(pwd || salt || basil)
       ptrWord += BLOCK_LEN_BLAKE2_SAFE_INT64; //goes to next block of pad(pwd || salt || basil)
     }
 
     //Initializes M[0] and M[1]
-    reducedSqueezeRow0(state, memMatrix[0], nCols); //The locally copied password is most likely overwritten here
-    reducedDuplexRow1(state, memMatrix[0], memMatrix[1], nCols);
+    sp->reducedSqueezeRow0(state, MEM_MATRIX(0), nCols); //The locally copied password is most likely overwritten here
+    sp->reducedDuplexRow1(state, MEM_MATRIX(0), MEM_MATRIX(1), nCols);
 
     do {
       //M[row] = rand; //M[row*] = M[row*] XOR rotW(rand)
-      reducedDuplexRowSetup(state, memMatrix[prev], memMatrix[rowa], memMatrix[row], nCols);
+      sp->reducedDuplexRowSetup(state, MEM_MATRIX(prev), MEM_MATRIX(rowa), MEM_MATRIX(row), nCols);
 
 
       //updates the value of row* (deterministically picked during Setup))
@@ -177,7 +179,7 @@ int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *
         //------------------------------------------------------------------------------------------
 
         //Performs a reduced-round duplexing operation over M[row*] XOR M[prev], updating both M[row*] and M[row]
-        reducedDuplexRow(state, memMatrix[prev], memMatrix[rowa], memMatrix[row], nCols);
+        sp->reducedDuplexRow(state, MEM_MATRIX(prev), MEM_MATRIX(rowa), MEM_MATRIX(row), nCols);
 
         //update prev: it now points to the last row ever computed
         prev = row;
@@ -194,20 +196,15 @@ int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *
 
     //============================ Wrap-up Phase ===============================//
     //Absorbs the last block of the memory matrix
-    absorbBlock(state, memMatrix[rowa]);
+    sp->absorbBlock(state, MEM_MATRIX(rowa));
+#undef MEM_MATRIX
 
     //Squeezes the key
     squeeze(state, K, kLen);
     //==========================================================================/
 
-    //========================= Freeing the memory =============================//
-    free(memMatrix);
-    free(wholeMatrix);
-
-    //Wiping out the sponge's internal state before freeing it
+    //Wiping out the sponge's internal state
     memset(state, 0, 16 * sizeof (uint64_t));
-    free(state);
-    //==========================================================================/
 
     return 0;
 }
@@ -37,11 +37,20 @@ typedef unsigned char byte;
         #define BLOCK_LEN_BYTES (BLOCK_LEN_INT64 * 8)    //Block length, in bytes
 #endif
 
+//Lyra2Z parameters: timeCost, nRows and nCols are fixed to 8 by consensus
+#define LYRA2Z_TIME_COST 8
+#define LYRA2Z_NROWS 8
+#define LYRA2Z_NCOLS 8
+#define LYRA2Z_MATRIX_INT64 (LYRA2Z_NROWS * LYRA2Z_NCOLS * BLOCK_LEN_INT64)   //Memory matrix size: 768 uint64_t
+#define LYRA2Z_MATRIX_BYTES (LYRA2Z_MATRIX_INT64 * 8)                         //same as above, in bytes (=6 KiB)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
     int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *salt, uint64_t saltlen, uint64_t timeCost, uint64_t nRows, uint64_t nCols);
+    int LYRA2_matrix(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *salt, uint64_t saltlen, uint64_t timeCost, uint64_t nRows, uint64_t nCols, uint64_t *wholeMatrix);
+    void LYRA2Z_4way(void *K, const void *pwd, uint64_t *matrix);
 
 #ifdef __cplusplus
 }
@@ -27,6 +27,10 @@
  * online backup system.
  */
 
+#if defined(HAVE_CONFIG_H)
+#include "npscoin-config.h"
+#endif
+
 #include "Lyra2Z.h"
 #include <stdlib.h>
 #include <stdint.h>
@@ -34,19 +38,168 @@
 #include <stdio.h>
 #include "sph_blake.h"
 #include "Lyra2.h"
+#include "Sponge.h"
 
-void lyra2z_hash(const char* input, char* output)
-{
-    sph_blake256_context     ctx_blake;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <cpuid.h>
+#define USE_CPUID 1
+#endif
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* LYRA2Z_MATRIX_SIZE is public, make sure it matches the actual parameters */
+typedef char lyra2z_matrix_size_check[(LYRA2Z_MATRIX_SIZE == LYRA2Z_MATRIX_BYTES) ? 1 : -1];
 
+static THREAD_LOCAL uint64_t lyra2zMatrix[LYRA2Z_MATRIX_INT64] ALIGN;
+#if defined(ENABLE_AVX2) && defined(USE_CPUID)
+/* Four interleaved matrices, for LYRA2Z_4way() */
+static THREAD_LOCAL uint64_t lyra2zMatrix4way[4 * LYRA2Z_MATRIX_INT64] ALIGN;
+#endif
+
+static const char* const implNames[LYRA2Z_IMPL_COUNT] = {"generic", "sse2", "avx2"};
+static int implSelected = LYRA2Z_IMPL_GENERIC;
+
+/* Second half of Lyra2Z: Lyra2 over the Blake256 hash of the header */
+static void lyra2z_finish(sph_blake256_context* ctx_blake, char* output, uint64_t* matrix)
+{
     uint32_t hashA[8], hashB[8];
 
+    sph_blake256_close (ctx_blake, hashA);
+
+    LYRA2_matrix(hashB, 32, hashA, 32, hashA, 32, LYRA2Z_TIME_COST, LYRA2Z_NROWS, LYRA2Z_NCOLS, matrix);
+
+    memcpy(output, hashB, 32);
+}
+
+void lyra2z_hash_matrix(const char* input, char* output, uint64_t* matrix)
+{
+    sph_blake256_context     ctx_blake;
+
     sph_blake256_init(&ctx_blake);
     sph_blake256 (&ctx_blake, input, 80);
-    sph_blake256_close (&ctx_blake, hashA);	
-	
-	LYRA2(hashB, 32, hashA, 32, hashA, 32, 8, 8, 8);
-	
-	memcpy(output, hashB, 32);
+    lyra2z_finish(&ctx_blake, output, matrix);
+}
+
+void lyra2z_hash(const char* input, char* output)
+{
+    lyra2z_hash_matrix(input, output, lyra2zMatrix);
+}
+
+void lyra2z_midstate_init(lyra2z_midstate* midstate, const char* input)
+{
+    /* Blake256 compresses a block as soon as it is complete, so all that is left is the tail */
+    sph_blake256_init(midstate);
+    sph_blake256(midstate, input, LYRA2Z_MIDSTATE_BYTES);
+}
+
+void lyra2z_hash_midstate(const lyra2z_midstate* midstate, const char* input, char* output)
+{
+    sph_blake256_context ctx_blake = *midstate;
+
+    sph_blake256(&ctx_blake, input + LYRA2Z_MIDSTATE_BYTES, 80 - LYRA2Z_MIDSTATE_BYTES);
+    lyra2z_finish(&ctx_blake, output, lyra2zMatrix);
+}
+
+void lyra2z_hash_many(const char* input, char* output, size_t count)
+{
+#if defined(ENABLE_AVX2) && defined(USE_CPUID)
+    if (implSelected == LYRA2Z_IMPL_AVX2) {
+        sph_blake256_context ctx_blake;
+        uint32_t hashA[4 * 8];
+        int i;
+
+        for (; count >= 4; count -= 4) {
+            for (i = 0; i < 4; i++) {
+                sph_blake256_init(&ctx_blake);
+                sph_blake256(&ctx_blake, input + i * 80, 80);
+                sph_blake256_close(&ctx_blake, hashA + i * 8);
+            }
+
+            LYRA2Z_4way(output, hashA, lyra2zMatrix4way);
+
+            input += 4 * 80;
+            output += 4 * 32;
+        }
+    }
+#endif
+
+    for (; count > 0; count--) {
+        lyra2z_hash(input, output);
+        input += 80;
+        output += 32;
+    }
+}
+
+#if defined(USE_CPUID)
+static int cpuHasAVX2(void)
+{
+    unsigned int a, b, c, d, xcr0_lo, xcr0_hi;
+    if (__get_cpuid_max(0, NULL) < 7) return 0;
+    __cpuid(1, a, b, c, d);
+    /* AVX, and the OS saves the YMM registers (OSXSAVE + XCR0 bits 1 and 2) */
+    if (!((c >> 27) & 1) || !((c >> 28) & 1)) return 0;
+    __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) return 0;
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b >> 5) & 1;
+}
+#endif
+
+int lyra2z_impl_supported(int impl)
+{
+    switch (impl) {
+    case LYRA2Z_IMPL_GENERIC:
+        return 1;
+#if defined(__SSE2__)
+    case LYRA2Z_IMPL_SSE2:
+        return 1;
+#endif
+#if defined(ENABLE_AVX2) && defined(USE_CPUID)
+    case LYRA2Z_IMPL_AVX2:
+        return cpuHasAVX2();
+#endif
+    default:
+        return 0;
+    }
+}
+
+int lyra2z_select_impl(int impl)
+{
+    if (!lyra2z_impl_supported(impl)) return 0;
+    switch (impl) {
+#if defined(__SSE2__)
+    case LYRA2Z_IMPL_SSE2:
+        lyra2Sponge = &spongeSSE2;
+        break;
+#endif
+#if defined(ENABLE_AVX2) && defined(USE_CPUID)
+    case LYRA2Z_IMPL_AVX2:
+        lyra2Sponge = &spongeAVX2;
+        break;
+#endif
+    default:
+        lyra2Sponge = &spongeGeneric;
+        break;
+    }
+    implSelected = impl;
+    return 1;
+}
+
+const char* lyra2z_impl_name(void)
+{
+    return implNames[implSelected];
 }
 
+const char* lyra2z_autodetect(void)
+{
+    int impl;
+    for (impl = LYRA2Z_IMPL_COUNT - 1; impl > LYRA2Z_IMPL_GENERIC; impl--) {
+        if (lyra2z_select_impl(impl)) break;
+    }
+    if (impl == LYRA2Z_IMPL_GENERIC) lyra2z_select_impl(impl);
+    return lyra2z_impl_name();
+}
@@ -1,12 +1,75 @@
 #ifndef LYRA2RE_H
 #define LYRA2RE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sph_blake.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** Bytes of scratch space needed by lyra2z_hash_matrix() */
+#define LYRA2Z_MATRIX_SIZE 6144
+
+/** Sponge implementations, in order of preference */
+enum {
+    LYRA2Z_IMPL_GENERIC = 0,
+    LYRA2Z_IMPL_SSE2,
+    LYRA2Z_IMPL_AVX2,
+    LYRA2Z_IMPL_COUNT
+};
+
+/**
+ * Hash an 80-byte block header into 32 bytes of output. Reentrant: the memory
+ * matrix is a per-thread buffer, so no allocation takes place.
+ */
 void lyra2z_hash(const char* input, char* output);
 
+/** Same as lyra2z_hash(), using a caller-provided LYRA2Z_MATRIX_SIZE byte matrix */
+void lyra2z_hash_matrix(const char* input, char* output, uint64_t* matrix);
+
+/** Number of leading header bytes covered by a midstate */
+#define LYRA2Z_MIDSTATE_BYTES 64
+
+/**
+ * Blake256 state after the first LYRA2Z_MIDSTATE_BYTES bytes of a header, i.e.
+ * nVersion, hashPrevBlock and most of hashMerkleRoot. It stays valid while only
+ * nTime, nBits or nNonce change, as when searching for a nonce. Midstates are
+ * plain values owned by the caller, so any number of threads can use their own.
+ */
+typedef sph_blake256_context lyra2z_midstate;
+
+/** Compute the midstate of an 80-byte header (only the first 64 bytes are read) */
+void lyra2z_midstate_init(lyra2z_midstate* midstate, const char* input);
+
+/**
+ * Same as lyra2z_hash(), for a header whose first 64 bytes are those the
+ * midstate was computed for. Only the last 16 bytes of input are read.
+ */
+void lyra2z_hash_midstate(const lyra2z_midstate* midstate, const char* input, char* output);
+
+/**
+ * Hash count 80-byte headers, stored back to back in input, into count 32-byte
+ * hashes stored back to back in output. With the AVX2 implementation headers are
+ * hashed four at a time in parallel lanes, which is much faster than calling
+ * lyra2z_hash() on each of them.
+ */
+void lyra2z_hash_many(const char* input, char* output, size_t count);
+
+/** Whether an implementation was compiled in and is supported by this CPU */
+int lyra2z_impl_supported(int impl);
+
+/** Switch to the given implementation; returns 0 if it is not supported. Not thread-safe. */
+int lyra2z_select_impl(int impl);
+
+/** Name of the implementation currently in use */
+const char* lyra2z_impl_name(void);
+
+/** Select the fastest supported implementation and return its name. Not thread-safe. */
+const char* lyra2z_autodetect(void);
+
 #ifdef __cplusplus
 }
 #endif
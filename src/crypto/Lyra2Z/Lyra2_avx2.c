@@ -0,0 +1,292 @@
+/**
+ * Four-way AVX2 implementation of Lyra2 with the Lyra2Z parameters.
+ *
+ * Four independent Lyra2 instances run side by side: lane i of every 256-bit
+ * register belongs to the i-th instance, so Blake2b's rounds need no lane
+ * permutations at all. The four memory matrices are interleaved word by word,
+ * which makes the rows visited in the Setup phase (and rows "prev" and "row"
+ * of the Wandering phase) plain vector loads and stores; only the pseudorandom
+ * row* differs between lanes and is accessed one lane at a time (gathers and
+ * masked stores turned out to be slower than scalar accesses).
+ * The results are bit-identical to LYRA2() in Lyra2.c. This file is compiled
+ * with AVX2 code generation enabled and must only be called after checking
+ * that the CPU supports it (see lyra2z_hash_many()).
+ *
+ * This software is hereby placed in the public domain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <string.h>
+#include "Lyra2.h"
+#include "Sponge.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+#define LOAD(p)     _mm256_load_si256((const __m256i*)(p))
+#define STORE(p, r) _mm256_store_si256((__m256i*)(p), (r))
+
+#define ROTR32(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24(x) _mm256_shuffle_epi8((x), rotr24)
+#define ROTR16(x) _mm256_shuffle_epi8((x), rotr16)
+#define ROTR63(x) _mm256_or_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+
+/*Blake2b's G function, on the same column (or diagonal) of four states*/
+#define G_4WAY(a, b, c, d) \
+  do { \
+    a = _mm256_add_epi64(a, b); \
+    d = ROTR32(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi64(c, d); \
+    b = ROTR24(_mm256_xor_si256(b, c)); \
+    a = _mm256_add_epi64(a, b); \
+    d = ROTR16(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi64(c, d); \
+    b = ROTR63(_mm256_xor_si256(b, c)); \
+  } while(0)
+
+/**
+ * One round of Blake2b's compression function over four states, where
+ * v[i] contains word i of each of them.
+ */
+static ALWAYS_INLINE void roundLyra4way(__m256i *v) {
+    const __m256i rotr24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+                                            3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    const __m256i rotr16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+                                            2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    G_4WAY(v[ 0], v[ 4], v[ 8], v[12]);
+    G_4WAY(v[ 1], v[ 5], v[ 9], v[13]);
+    G_4WAY(v[ 2], v[ 6], v[10], v[14]);
+    G_4WAY(v[ 3], v[ 7], v[11], v[15]);
+    G_4WAY(v[ 0], v[ 5], v[10], v[15]);
+    G_4WAY(v[ 1], v[ 6], v[11], v[12]);
+    G_4WAY(v[ 2], v[ 7], v[ 8], v[13]);
+    G_4WAY(v[ 3], v[ 4], v[ 9], v[14]);
+}
+
+static void blake2bLyra4way(__m256i *v) {
+    int i;
+    for (i = 0; i < 12; i++) {
+        roundLyra4way(v);
+    }
+}
+
+/*The loops over the words of a column are unrolled by hand so that the state can stay in registers*/
+#define FOR_EACH_WORD(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11)
+
+//rotW(rand): word j of M[row*] is XORed with word j-1 of the state
+#define ROTW_WORD(j) (((j) + BLOCK_LEN_INT64 - 1) % BLOCK_LEN_INT64)
+
+//Address of word 0 of column "col" of row "row" in the interleaved matrices: each word is 4 lanes wide
+#define COLUMN(m, row, col) ((m) + (((row) * LYRA2Z_NCOLS + (col)) * BLOCK_LEN_INT64) * 4)
+
+/**
+ * Performs reducedDuplexRow() on four matrices at once, with a different
+ * row* (rowInOut[lane]) in each of them.
+ */
+static void reducedDuplexRow4way(__m256i *state, uint64_t *m, int64_t rowIn, const int64_t rowInOut[4], int64_t rowOut) {
+    uint64_t *p0 = COLUMN(m, rowInOut[0], 0) + 0;
+    uint64_t *p1 = COLUMN(m, rowInOut[1], 0) + 1;
+    uint64_t *p2 = COLUMN(m, rowInOut[2], 0) + 2;
+    uint64_t *p3 = COLUMN(m, rowInOut[3], 0) + 3;
+    uint64_t rand[BLOCK_LEN_INT64][4] ALIGN;
+    int64_t col;
+
+    for (col = 0; col < LYRA2Z_NCOLS; col++) {
+        const uint64_t *ptrWordIn = COLUMN(m, rowIn, col);
+        uint64_t *ptrWordOut = COLUMN(m, rowOut, col);
+
+        //Absorbing "M[prev] [+] M[row*]"
+#define ABSORB_WORD(j) \
+        state[j] = _mm256_xor_si256(state[j], _mm256_add_epi64(LOAD(ptrWordIn + (j) * 4), \
+                   _mm256_setr_epi64x(p0[(j) * 4], p1[(j) * 4], p2[(j) * 4], p3[(j) * 4])));
+        FOR_EACH_WORD(ABSORB_WORD)
+#undef ABSORB_WORD
+
+        roundLyra4way(state);
+
+        //M[rowOut][col] = M[rowOut][col] XOR rand
+#define OUTPUT_WORD(j) \
+        STORE(ptrWordOut + (j) * 4, _mm256_xor_si256(LOAD(ptrWordOut + (j) * 4), state[j])); \
+        STORE(rand[j], state[j]);
+        FOR_EACH_WORD(OUTPUT_WORD)
+#undef OUTPUT_WORD
+
+        //M[rowInOut][col] = M[rowInOut][col] XOR rotW(rand), lane by lane; done last as row* may be rowOut
+#define ROTW_OUTPUT_WORD(j) \
+        p0[(j) * 4] ^= rand[ROTW_WORD(j)][0]; p1[(j) * 4] ^= rand[ROTW_WORD(j)][1]; \
+        p2[(j) * 4] ^= rand[ROTW_WORD(j)][2]; p3[(j) * 4] ^= rand[ROTW_WORD(j)][3];
+        FOR_EACH_WORD(ROTW_OUTPUT_WORD)
+#undef ROTW_OUTPUT_WORD
+
+        p0 += BLOCK_LEN_INT64 * 4;
+        p1 += BLOCK_LEN_INT64 * 4;
+        p2 += BLOCK_LEN_INT64 * 4;
+        p3 += BLOCK_LEN_INT64 * 4;
+    }
+}
+
+/**
+ * Computes Lyra2 with the Lyra2Z parameters (timeCost = nRows = nCols = 8,
+ * 32-byte output, password and salt both equal to the same 32 bytes) for four
+ * inputs at once.
+ *
+ * @param K      Receives the four 32-byte keys, back to back
+ * @param pwd    The four 32-byte passwords (which are also used as salts), back to back
+ * @param matrix Scratch space of 4 * LYRA2Z_MATRIX_BYTES bytes, aligned to 32 bytes
+ */
+void LYRA2Z_4way(void *K, const void *pwd, uint64_t *matrix) {
+    __m256i state[16];
+    uint64_t words[4][4] ALIGN;
+    int64_t row = 2, prev = 1, rowa = 0, tau, step = 1, window = 2, gap = 1, col, j;
+    int64_t rowas[4];
+
+    //======================= Initializing the Sponge State ====================//
+    for (j = 0; j < 8; j++) {
+        state[j] = _mm256_setzero_si256();
+        state[8 + j] = _mm256_set1_epi64x(blake2b_IV[j]);
+    }
+
+    //============ Absorbing password + salt + basil padded with 10*1 ==========//
+    //First block: the password, then the salt, which is the same
+    memcpy(words, pwd, sizeof(words));
+    for (j = 0; j < 4; j++) {
+        __m256i w = _mm256_setr_epi64x(words[0][j], words[1][j], words[2][j], words[3][j]);
+        state[j] = _mm256_xor_si256(state[j], w);
+        state[4 + j] = _mm256_xor_si256(state[4 + j], w);
+    }
+    blake2bLyra4way(state);
+
+    //Second block: the basil (kLen, pwdlen, saltlen, timeCost, nRows, nCols) and the padding
+    state[0] = _mm256_xor_si256(state[0], _mm256_set1_epi64x(32));
+    state[1] = _mm256_xor_si256(state[1], _mm256_set1_epi64x(32));
+    state[2] = _mm256_xor_si256(state[2], _mm256_set1_epi64x(32));
+    state[3] = _mm256_xor_si256(state[3], _mm256_set1_epi64x(LYRA2Z_TIME_COST));
+    state[4] = _mm256_xor_si256(state[4], _mm256_set1_epi64x(LYRA2Z_NROWS));
+    state[5] = _mm256_xor_si256(state[5], _mm256_set1_epi64x(LYRA2Z_NCOLS));
+    state[6] = _mm256_xor_si256(state[6], _mm256_set1_epi64x(0x80));
+    state[7] = _mm256_xor_si256(state[7], _mm256_set1_epi64x(0x0100000000000000LL));
+    blake2bLyra4way(state);
+
+    //================================ Setup Phase =============================//
+    //M[0][C-1-col] = H.reduced_squeeze()
+    for (col = 0; col < LYRA2Z_NCOLS; col++) {
+        uint64_t *ptrWordOut = COLUMN(matrix, 0, LYRA2Z_NCOLS - 1 - col);
+#define SQUEEZE_WORD(j) STORE(ptrWordOut + (j) * 4, state[j]);
+        FOR_EACH_WORD(SQUEEZE_WORD)
+#undef SQUEEZE_WORD
+        roundLyra4way(state);
+    }
+
+    //M[1][C-1-col] = M[0][col] XOR H.reduced_duplex(M[0][col])
+    for (col = 0; col < LYRA2Z_NCOLS; col++) {
+        const uint64_t *ptrWordIn = COLUMN(matrix, 0, col);
+        uint64_t *ptrWordOut = COLUMN(matrix, 1, LYRA2Z_NCOLS - 1 - col);
+#define ABSORB_WORD(j) state[j] = _mm256_xor_si256(state[j], LOAD(ptrWordIn + (j) * 4));
+        FOR_EACH_WORD(ABSORB_WORD)
+#undef ABSORB_WORD
+        roundLyra4way(state);
+#define OUTPUT_WORD(j) STORE(ptrWordOut + (j) * 4, _mm256_xor_si256(LOAD(ptrWordIn + (j) * 4), state[j]));
+        FOR_EACH_WORD(OUTPUT_WORD)
+#undef OUTPUT_WORD
+    }
+
+    do {
+        //M[row] = rand; //M[row*] = M[row*] XOR rotW(rand)
+        for (col = 0; col < LYRA2Z_NCOLS; col++) {
+            const uint64_t *ptrWordIn = COLUMN(matrix, prev, col);
+            uint64_t *ptrWordInOut = COLUMN(matrix, rowa, col);
+            uint64_t *ptrWordOut = COLUMN(matrix, row, LYRA2Z_NCOLS - 1 - col);
+            //Absorbing "M[prev] [+] M[row*]"
+#define ABSORB_WORD(j) \
+            state[j] = _mm256_xor_si256(state[j], _mm256_add_epi64(LOAD(ptrWordIn + (j) * 4), LOAD(ptrWordInOut + (j) * 4)));
+            FOR_EACH_WORD(ABSORB_WORD)
+#undef ABSORB_WORD
+            roundLyra4way(state);
+            //M[row][col] = M[prev][col] XOR rand; M[row*][col] = M[row*][col] XOR rotW(rand)
+#define OUTPUT_WORD(j) \
+            STORE(ptrWordOut + (j) * 4, _mm256_xor_si256(LOAD(ptrWordIn + (j) * 4), state[j])); \
+            STORE(ptrWordInOut + (j) * 4, _mm256_xor_si256(LOAD(ptrWordInOut + (j) * 4), state[ROTW_WORD(j)]));
+            FOR_EACH_WORD(OUTPUT_WORD)
+#undef OUTPUT_WORD
+        }
+
+        //updates the value of row* (deterministically picked during Setup))
+        rowa = (rowa + step) & (window - 1);
+        //update prev: it now points to the last row ever computed
+        prev = row;
+        //updates row: goes to the next row to be computed
+        row++;
+
+        //Checks if all rows in the window where visited.
+        if (rowa == 0) {
+            step = window + gap; //changes the step: approximately doubles its value
+            window *= 2; //doubles the size of the re-visitation window
+            gap = -gap; //inverts the modifier to the step
+        }
+    } while (row < LYRA2Z_NROWS);
+
+    //============================ Wandering Phase =============================//
+    row = 0;
+    for (tau = 1; tau <= LYRA2Z_TIME_COST; tau++) {
+        step = (tau % 2 == 0) ? -1 : LYRA2Z_NROWS / 2 - 1;
+        do {
+            //Selects a pseudorandom index row* for each lane
+            STORE(words[0], state[0]);
+            for (j = 0; j < 4; j++) {
+                rowas[j] = words[0][j] % LYRA2Z_NROWS;
+            }
+
+            reducedDuplexRow4way(state, matrix, prev, rowas, row);
+
+            prev = row;
+            row = (uint64_t)(row + step) % LYRA2Z_NROWS;
+        } while (row != 0);
+    }
+
+    //============================ Wrap-up Phase ===============================//
+    //Absorbs the last block of the memory matrix, i.e., column 0 of each lane's last row*
+    {
+        const uint64_t *p0 = COLUMN(matrix, rowas[0], 0) + 0;
+        const uint64_t *p1 = COLUMN(matrix, rowas[1], 0) + 1;
+        const uint64_t *p2 = COLUMN(matrix, rowas[2], 0) + 2;
+        const uint64_t *p3 = COLUMN(matrix, rowas[3], 0) + 3;
+#define ABSORB_WORD(j) \
+        state[j] = _mm256_xor_si256(state[j], _mm256_setr_epi64x(p0[(j) * 4], p1[(j) * 4], p2[(j) * 4], p3[(j) * 4]));
+        FOR_EACH_WORD(ABSORB_WORD)
+#undef ABSORB_WORD
+        blake2bLyra4way(state);
+    }
+
+    //Squeezes the keys: the first 4 words of each lane
+    {
+        uint64_t squeezed[4][4] ALIGN;
+        for (j = 0; j < 4; j++) {
+            STORE(squeezed[j], state[j]);
+        }
+        for (j = 0; j < 4; j++) {
+            words[j][0] = squeezed[0][j];
+            words[j][1] = squeezed[1][j];
+            words[j][2] = squeezed[2][j];
+            words[j][3] = squeezed[3][j];
+        }
+        memcpy(K, words, sizeof(words));
+    }
+}
+
+#endif /* __AVX2__ */
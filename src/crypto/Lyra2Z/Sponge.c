@@ -730,6 +730,17 @@ inline void reducedDuplexRowd(uint64_t *state, uint64_t *rowIn, uint64_t *rowInO
 }
 */
 
+const spongeImpl spongeGeneric = {
+    absorbBlock,
+    absorbBlockBlake2Safe,
+    reducedSqueezeRow0,
+    reducedDuplexRow1,
+    reducedDuplexRowSetup,
+    reducedDuplexRow
+};
+
+const spongeImpl *lyra2Sponge = &spongeGeneric;
+
 /**
  Prints an array of unsigned chars
  */
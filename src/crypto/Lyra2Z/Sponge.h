@@ -92,6 +92,27 @@ void reducedDuplexRow(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint
 //---- Misc
 void printArray(unsigned char *array, unsigned int size, char *name);
 
+//---- Implementations
+/**
+ * The sponge operations used by Lyra2's Setup and Wandering phases. The portable
+ * version is defined in Sponge.c, vectorized ones in Sponge_sse2.c and Sponge_avx2.c;
+ * all of them produce bit-identical results. lyra2Sponge points to the one in use and
+ * is changed only by lyra2z_select_impl() (see Lyra2Z.h), normally once at startup.
+ */
+typedef struct {
+    void (*absorbBlock)(uint64_t *state, const uint64_t *in);
+    void (*absorbBlockBlake2Safe)(uint64_t *state, const uint64_t *in);
+    void (*reducedSqueezeRow0)(uint64_t* state, uint64_t* rowOut, uint64_t nCols);
+    void (*reducedDuplexRow1)(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, uint64_t nCols);
+    void (*reducedDuplexRowSetup)(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols);
+    void (*reducedDuplexRow)(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols);
+} spongeImpl;
+
+extern const spongeImpl spongeGeneric;
+extern const spongeImpl spongeSSE2;
+extern const spongeImpl spongeAVX2;
+extern const spongeImpl *lyra2Sponge;
+
 ////////////////////////////////////////////////////////////////////////////////////////////////
 
 
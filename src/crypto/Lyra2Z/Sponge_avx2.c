@@ -0,0 +1,229 @@
+/**
+ * AVX2 implementation of the reduced-round Blake2b sponge used by Lyra2.
+ *
+ * Each 256-bit register holds one row of Blake2b's 4x4 state matrix, so a
+ * round is four vectorized G steps plus lane permutations; a column of the
+ * Lyra2 memory matrix (12 words) is exactly three registers. The results are
+ * bit-identical to the portable functions in Sponge.c. This file is compiled
+ * with AVX2 code generation enabled and must only be called after checking
+ * that the CPU supports it (see lyra2z_autodetect()).
+ *
+ * This software is hereby placed in the public domain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "Sponge.h"
+#include "Lyra2.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+#define LOADU(p)     _mm256_loadu_si256((const __m256i*)(p))
+#define STOREU(p, r) _mm256_storeu_si256((__m256i*)(p), (r))
+
+#define ROTR32(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24(x) _mm256_or_si256(_mm256_srli_epi64((x), 24), _mm256_slli_epi64((x), 40))
+#define ROTR16(x) _mm256_or_si256(_mm256_srli_epi64((x), 16), _mm256_slli_epi64((x), 48))
+#define ROTR63(x) _mm256_or_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+
+/*Blake2b's G function, applied to all four columns (or diagonals) at once*/
+#define G_AVX2(a, b, c, d) \
+  do { \
+    a = _mm256_add_epi64(a, b); \
+    d = ROTR32(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi64(c, d); \
+    b = ROTR24(_mm256_xor_si256(b, c)); \
+    a = _mm256_add_epi64(a, b); \
+    d = ROTR16(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi64(c, d); \
+    b = ROTR63(_mm256_xor_si256(b, c)); \
+  } while(0)
+
+/**
+ * One round of Blake2b's compression function over the state held in
+ * v[0..3], where v[i] contains the state words 4i to 4i+3.
+ */
+static ALWAYS_INLINE void roundLyraAVX2(__m256i *v) {
+    G_AVX2(v[0], v[1], v[2], v[3]);
+    //Diagonalize: brings v[5], v[10], v[15] (and so on) below v[0]
+    v[1] = _mm256_permute4x64_epi64(v[1], _MM_SHUFFLE(0, 3, 2, 1));
+    v[2] = _mm256_permute4x64_epi64(v[2], _MM_SHUFFLE(1, 0, 3, 2));
+    v[3] = _mm256_permute4x64_epi64(v[3], _MM_SHUFFLE(2, 1, 0, 3));
+    G_AVX2(v[0], v[1], v[2], v[3]);
+    //Undiagonalize
+    v[1] = _mm256_permute4x64_epi64(v[1], _MM_SHUFFLE(2, 1, 0, 3));
+    v[2] = _mm256_permute4x64_epi64(v[2], _MM_SHUFFLE(1, 0, 3, 2));
+    v[3] = _mm256_permute4x64_epi64(v[3], _MM_SHUFFLE(0, 3, 2, 1));
+}
+
+/*The column loops are unrolled by hand so that the state never leaves the registers*/
+#define LOAD_STATE(v, p) \
+    v[0] = LOADU((p) + 0); v[1] = LOADU((p) + 4); v[2] = LOADU((p) + 8); v[3] = LOADU((p) + 12);
+
+#define STORE_STATE(p, v) \
+    STOREU((p) + 0, v[0]); STOREU((p) + 4, v[1]); STOREU((p) + 8, v[2]); STOREU((p) + 12, v[3]);
+
+/*Loads one column (BLOCK_LEN_INT64 words)*/
+#define LOAD_COLUMN(r, p) \
+    r[0] = LOADU((p) + 0); r[1] = LOADU((p) + 4); r[2] = LOADU((p) + 8);
+
+/*Stores op(r[i], s[i]) into one column*/
+#define STORE_COLUMN_OP(p, op, r, s) \
+    STOREU((p) + 0, op(r[0], s[0])); STOREU((p) + 4, op(r[1], s[1])); STOREU((p) + 8, op(r[2], s[2]));
+
+/*r[i] = op(r[i], s[i]) over one column*/
+#define COLUMN_OP(r, op, s) \
+    r[0] = op(r[0], s[0]); r[1] = op(r[1], s[1]); r[2] = op(r[2], s[2]);
+
+/*rotW(rand): the bitrate part of the state (v[0..2]) rotated by one word*/
+#define ROTW(r, v) \
+    do { \
+        __m256i t0 = _mm256_permute4x64_epi64(v[0], _MM_SHUFFLE(2, 1, 0, 3)); \
+        __m256i t1 = _mm256_permute4x64_epi64(v[1], _MM_SHUFFLE(2, 1, 0, 3)); \
+        __m256i t2 = _mm256_permute4x64_epi64(v[2], _MM_SHUFFLE(2, 1, 0, 3)); \
+        r[0] = _mm256_blend_epi32(t0, t2, 0x03); \
+        r[1] = _mm256_blend_epi32(t1, t0, 0x03); \
+        r[2] = _mm256_blend_epi32(t2, t1, 0x03); \
+    } while(0)
+
+static void blake2bLyraAVX2(uint64_t *state) {
+    __m256i v[4];
+    int i;
+    LOAD_STATE(v, state);
+    for (i = 0; i < 12; i++) {
+        roundLyraAVX2(v);
+    }
+    STORE_STATE(state, v);
+}
+
+static void absorbBlockAVX2(uint64_t *state, const uint64_t *in) {
+    __m256i v[3], b[3];
+    LOAD_COLUMN(v, state);
+    LOAD_COLUMN(b, in);
+    STORE_COLUMN_OP(state, _mm256_xor_si256, v, b);
+    blake2bLyraAVX2(state);
+}
+
+static void absorbBlockBlake2SafeAVX2(uint64_t *state, const uint64_t *in) {
+    STOREU(state + 0, _mm256_xor_si256(LOADU(state + 0), LOADU(in + 0)));
+    STOREU(state + 4, _mm256_xor_si256(LOADU(state + 4), LOADU(in + 4)));
+    blake2bLyraAVX2(state);
+}
+
+static void reducedSqueezeRow0AVX2(uint64_t* state, uint64_t* rowOut, uint64_t nCols) {
+    uint64_t* ptrWord = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to M[0][C-1]
+    __m256i v[4];
+    uint64_t i;
+    LOAD_STATE(v, state);
+    for (i = 0; i < nCols; i++) {
+        //M[row][C-1-col] = H.reduced_squeeze()
+        STOREU(ptrWord + 0, v[0]); STOREU(ptrWord + 4, v[1]); STOREU(ptrWord + 8, v[2]);
+        ptrWord -= BLOCK_LEN_INT64;
+        roundLyraAVX2(v);
+    }
+    STORE_STATE(state, v);
+}
+
+static void reducedDuplexRow1AVX2(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, uint64_t nCols) {
+    uint64_t* ptrWordIn = rowIn;                               //In Lyra2: pointer to prev
+    uint64_t* ptrWordOut = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to row
+    __m256i v[4], in[3];
+    uint64_t i;
+    LOAD_STATE(v, state);
+    for (i = 0; i < nCols; i++) {
+        //Absorbing "M[prev][col]"
+        LOAD_COLUMN(in, ptrWordIn);
+        COLUMN_OP(v, _mm256_xor_si256, in);
+        roundLyraAVX2(v);
+        //M[row][C-1-col] = M[prev][col] XOR rand
+        STORE_COLUMN_OP(ptrWordOut, _mm256_xor_si256, in, v);
+        ptrWordIn += BLOCK_LEN_INT64;
+        ptrWordOut -= BLOCK_LEN_INT64;
+    }
+    STORE_STATE(state, v);
+}
+
+static void reducedDuplexRowSetupAVX2(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
+    uint64_t* ptrWordIn = rowIn;                               //In Lyra2: pointer to prev
+    uint64_t* ptrWordInOut = rowInOut;                         //In Lyra2: pointer to row*
+    uint64_t* ptrWordOut = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to row
+    __m256i v[4], in[3], col[3], rot[3];
+    uint64_t i;
+    LOAD_STATE(v, state);
+    for (i = 0; i < nCols; i++) {
+        //Absorbing "M[prev] [+] M[row*]"
+        LOAD_COLUMN(in, ptrWordIn);
+        LOAD_COLUMN(col, ptrWordInOut);
+        COLUMN_OP(col, _mm256_add_epi64, in);
+        COLUMN_OP(v, _mm256_xor_si256, col);
+        roundLyraAVX2(v);
+        //M[row][col] = M[prev][col] XOR rand
+        STORE_COLUMN_OP(ptrWordOut, _mm256_xor_si256, in, v);
+        //M[row*][col] = M[row*][col] XOR rotW(rand)
+        LOAD_COLUMN(col, ptrWordInOut);
+        ROTW(rot, v);
+        STORE_COLUMN_OP(ptrWordInOut, _mm256_xor_si256, col, rot);
+        //Inputs: next column (i.e., next block in sequence)
+        ptrWordInOut += BLOCK_LEN_INT64;
+        ptrWordIn += BLOCK_LEN_INT64;
+        //Output: goes to previous column
+        ptrWordOut -= BLOCK_LEN_INT64;
+    }
+    STORE_STATE(state, v);
+}
+
+static void reducedDuplexRowAVX2(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
+    uint64_t* ptrWordInOut = rowInOut; //In Lyra2: pointer to row*
+    uint64_t* ptrWordIn = rowIn;       //In Lyra2: pointer to prev
+    uint64_t* ptrWordOut = rowOut;     //In Lyra2: pointer to row
+    __m256i v[4], in[3], col[3], rot[3];
+    uint64_t i;
+    LOAD_STATE(v, state);
+    for (i = 0; i < nCols; i++) {
+        //Absorbing "M[prev] [+] M[row*]"
+        LOAD_COLUMN(in, ptrWordIn);
+        LOAD_COLUMN(col, ptrWordInOut);
+        COLUMN_OP(in, _mm256_add_epi64, col);
+        COLUMN_OP(v, _mm256_xor_si256, in);
+        roundLyraAVX2(v);
+        //M[rowOut][col] = M[rowOut][col] XOR rand
+        LOAD_COLUMN(col, ptrWordOut);
+        STORE_COLUMN_OP(ptrWordOut, _mm256_xor_si256, col, v);
+        //M[rowInOut][col] = M[rowInOut][col] XOR rotW(rand); rowInOut may be rowOut, so it is reloaded
+        LOAD_COLUMN(col, ptrWordInOut);
+        ROTW(rot, v);
+        STORE_COLUMN_OP(ptrWordInOut, _mm256_xor_si256, col, rot);
+        //Goes to next block
+        ptrWordOut += BLOCK_LEN_INT64;
+        ptrWordInOut += BLOCK_LEN_INT64;
+        ptrWordIn += BLOCK_LEN_INT64;
+    }
+    STORE_STATE(state, v);
+}
+
+const spongeImpl spongeAVX2 = {
+    absorbBlockAVX2,
+    absorbBlockBlake2SafeAVX2,
+    reducedSqueezeRow0AVX2,
+    reducedDuplexRow1AVX2,
+    reducedDuplexRowSetupAVX2,
+    reducedDuplexRowAVX2
+};
+
+#endif /* __AVX2__ */
@@ -0,0 +1,243 @@
+/**
+ * SSE2 implementation of the reduced-round Blake2b sponge used by Lyra2.
+ *
+ * The 16-word sponge state is kept in eight 128-bit registers for the
+ * whole duration of a row operation, so it is loaded and stored only once
+ * per row instead of once per column. The results are bit-identical to the
+ * portable functions in Sponge.c.
+ *
+ * This software is hereby placed in the public domain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "Sponge.h"
+#include "Lyra2.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+#define LOADU(p)     _mm_loadu_si128((const __m128i*)(p))
+#define STOREU(p, r) _mm_storeu_si128((__m128i*)(p), (r))
+
+#define ROTR32(x) _mm_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24(x) _mm_or_si128(_mm_srli_epi64((x), 24), _mm_slli_epi64((x), 40))
+#define ROTR16(x) _mm_or_si128(_mm_srli_epi64((x), 16), _mm_slli_epi64((x), 48))
+#define ROTR63(x) _mm_or_si128(_mm_srli_epi64((x), 63), _mm_add_epi64((x), (x)))
+
+/*Blake2b's G function, applied to two columns (or diagonals) at once*/
+#define G_SSE2(a, b, c, d) \
+  do { \
+    a = _mm_add_epi64(a, b); \
+    d = ROTR32(_mm_xor_si128(d, a)); \
+    c = _mm_add_epi64(c, d); \
+    b = ROTR24(_mm_xor_si128(b, c)); \
+    a = _mm_add_epi64(a, b); \
+    d = ROTR16(_mm_xor_si128(d, a)); \
+    c = _mm_add_epi64(c, d); \
+    b = ROTR63(_mm_xor_si128(b, c)); \
+  } while(0)
+
+/**
+ * One round of Blake2b's compression function over the state held in
+ * v[0..7], where v[i] contains the state words 2i and 2i+1.
+ */
+static ALWAYS_INLINE void roundLyraSSE2(__m128i *v) {
+    __m128i t0, t1;
+
+    G_SSE2(v[0], v[2], v[4], v[6]);
+    G_SSE2(v[1], v[3], v[5], v[7]);
+
+    //Diagonalize: brings v[5], v[10], v[15] (and so on) below v[0]
+    t0 = v[4]; v[4] = v[5]; v[5] = t0;
+    t0 = v[2]; t1 = v[6];
+    v[2] = _mm_unpackhi_epi64(v[2], _mm_unpacklo_epi64(v[3], v[3]));
+    v[3] = _mm_unpackhi_epi64(v[3], _mm_unpacklo_epi64(t0, t0));
+    v[6] = _mm_unpackhi_epi64(v[7], _mm_unpacklo_epi64(v[6], v[6]));
+    v[7] = _mm_unpackhi_epi64(t1, _mm_unpacklo_epi64(v[7], v[7]));
+
+    G_SSE2(v[0], v[2], v[4], v[6]);
+    G_SSE2(v[1], v[3], v[5], v[7]);
+
+    //Undiagonalize
+    t0 = v[4]; v[4] = v[5]; v[5] = t0;
+    t0 = v[2]; t1 = v[6];
+    v[2] = _mm_unpackhi_epi64(v[3], _mm_unpacklo_epi64(v[2], v[2]));
+    v[3] = _mm_unpackhi_epi64(t0, _mm_unpacklo_epi64(v[3], v[3]));
+    v[6] = _mm_unpackhi_epi64(v[6], _mm_unpacklo_epi64(v[7], v[7]));
+    v[7] = _mm_unpackhi_epi64(v[7], _mm_unpacklo_epi64(t1, t1));
+}
+
+/*The column loops are unrolled by hand so that the state never leaves the registers*/
+#define LOAD_STATE(v, p) \
+    v[0] = LOADU((p) + 0); v[1] = LOADU((p) + 2); v[2] = LOADU((p) + 4); v[3] = LOADU((p) + 6); \
+    v[4] = LOADU((p) + 8); v[5] = LOADU((p) + 10); v[6] = LOADU((p) + 12); v[7] = LOADU((p) + 14);
+
+#define STORE_STATE(p, v) \
+    STOREU((p) + 0, v[0]); STOREU((p) + 2, v[1]); STOREU((p) + 4, v[2]); STOREU((p) + 6, v[3]); \
+    STOREU((p) + 8, v[4]); STOREU((p) + 10, v[5]); STOREU((p) + 12, v[6]); STOREU((p) + 14, v[7]);
+
+/*Loads one column (BLOCK_LEN_INT64 words)*/
+#define LOAD_COLUMN(r, p) \
+    r[0] = LOADU((p) + 0); r[1] = LOADU((p) + 2); r[2] = LOADU((p) + 4); \
+    r[3] = LOADU((p) + 6); r[4] = LOADU((p) + 8); r[5] = LOADU((p) + 10);
+
+/*Stores op(r[i], s[i]) into one column*/
+#define STORE_COLUMN_OP(p, op, r, s) \
+    STOREU((p) + 0, op(r[0], s[0])); STOREU((p) + 2, op(r[1], s[1])); STOREU((p) + 4, op(r[2], s[2])); \
+    STOREU((p) + 6, op(r[3], s[3])); STOREU((p) + 8, op(r[4], s[4])); STOREU((p) + 10, op(r[5], s[5]));
+
+/*r[i] = op(r[i], s[i]) over one column*/
+#define COLUMN_OP(r, op, s) \
+    r[0] = op(r[0], s[0]); r[1] = op(r[1], s[1]); r[2] = op(r[2], s[2]); \
+    r[3] = op(r[3], s[3]); r[4] = op(r[4], s[4]); r[5] = op(r[5], s[5]);
+
+/*rotW(rand): the bitrate part of the state rotated by one word*/
+#define SHIFT_PAIR(a, b) _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b), 1))
+#define ROTW(r, v) \
+    r[0] = SHIFT_PAIR(v[5], v[0]); r[1] = SHIFT_PAIR(v[0], v[1]); r[2] = SHIFT_PAIR(v[1], v[2]); \
+    r[3] = SHIFT_PAIR(v[2], v[3]); r[4] = SHIFT_PAIR(v[3], v[4]); r[5] = SHIFT_PAIR(v[4], v[5]);
+
+static void blake2bLyraSSE2(uint64_t *state) {
+    __m128i v[8];
+    int i;
+    LOAD_STATE(v, state);
+    for (i = 0; i < 12; i++) {
+        roundLyraSSE2(v);
+    }
+    STORE_STATE(state, v);
+}
+
+static void absorbBlockSSE2(uint64_t *state, const uint64_t *in) {
+    __m128i v[6], b[6];
+    LOAD_COLUMN(v, state);
+    LOAD_COLUMN(b, in);
+    STORE_COLUMN_OP(state, _mm_xor_si128, v, b);
+    blake2bLyraSSE2(state);
+}
+
+static void absorbBlockBlake2SafeSSE2(uint64_t *state, const uint64_t *in) {
+    STOREU(state + 0, _mm_xor_si128(LOADU(state + 0), LOADU(in + 0)));
+    STOREU(state + 2, _mm_xor_si128(LOADU(state + 2), LOADU(in + 2)));
+    STOREU(state + 4, _mm_xor_si128(LOADU(state + 4), LOADU(in + 4)));
+    STOREU(state + 6, _mm_xor_si128(LOADU(state + 6), LOADU(in + 6)));
+    blake2bLyraSSE2(state);
+}
+
+static void reducedSqueezeRow0SSE2(uint64_t* state, uint64_t* rowOut, uint64_t nCols) {
+    uint64_t* ptrWord = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to M[0][C-1]
+    __m128i v[8];
+    uint64_t i;
+    LOAD_STATE(v, state);
+    for (i = 0; i < nCols; i++) {
+        //M[row][C-1-col] = H.reduced_squeeze()
+        STOREU(ptrWord + 0, v[0]); STOREU(ptrWord + 2, v[1]); STOREU(ptrWord + 4, v[2]);
+        STOREU(ptrWord + 6, v[3]); STOREU(ptrWord + 8, v[4]); STOREU(ptrWord + 10, v[5]);
+        ptrWord -= BLOCK_LEN_INT64;
+        roundLyraSSE2(v);
+    }
+    STORE_STATE(state, v);
+}
+
+static void reducedDuplexRow1SSE2(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, uint64_t nCols) {
+    uint64_t* ptrWordIn = rowIn;                               //In Lyra2: pointer to prev
+    uint64_t* ptrWordOut = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to row
+    __m128i v[8], in[6];
+    uint64_t i;
+    LOAD_STATE(v, state);
+    for (i = 0; i < nCols; i++) {
+        //Absorbing "M[prev][col]"
+        LOAD_COLUMN(in, ptrWordIn);
+        COLUMN_OP(v, _mm_xor_si128, in);
+        roundLyraSSE2(v);
+        //M[row][C-1-col] = M[prev][col] XOR rand
+        STORE_COLUMN_OP(ptrWordOut, _mm_xor_si128, in, v);
+        ptrWordIn += BLOCK_LEN_INT64;
+        ptrWordOut -= BLOCK_LEN_INT64;
+    }
+    STORE_STATE(state, v);
+}
+
+static void reducedDuplexRowSetupSSE2(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
+    uint64_t* ptrWordIn = rowIn;                               //In Lyra2: pointer to prev
+    uint64_t* ptrWordInOut = rowInOut;                         //In Lyra2: pointer to row*
+    uint64_t* ptrWordOut = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to row
+    __m128i v[8], in[6], col[6], rot[6];
+    uint64_t i;
+    LOAD_STATE(v, state);
+    for (i = 0; i < nCols; i++) {
+        //Absorbing "M[prev] [+] M[row*]"
+        LOAD_COLUMN(in, ptrWordIn);
+        LOAD_COLUMN(col, ptrWordInOut);
+        COLUMN_OP(col, _mm_add_epi64, in);
+        COLUMN_OP(v, _mm_xor_si128, col);
+        roundLyraSSE2(v);
+        //M[row][col] = M[prev][col] XOR rand
+        STORE_COLUMN_OP(ptrWordOut, _mm_xor_si128, in, v);
+        //M[row*][col] = M[row*][col] XOR rotW(rand)
+        LOAD_COLUMN(col, ptrWordInOut);
+        ROTW(rot, v);
+        STORE_COLUMN_OP(ptrWordInOut, _mm_xor_si128, col, rot);
+        //Inputs: next column (i.e., next block in sequence)
+        ptrWordInOut += BLOCK_LEN_INT64;
+        ptrWordIn += BLOCK_LEN_INT64;
+        //Output: goes to previous column
+        ptrWordOut -= BLOCK_LEN_INT64;
+    }
+    STORE_STATE(state, v);
+}
+
+static void reducedDuplexRowSSE2(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
+    uint64_t* ptrWordInOut = rowInOut; //In Lyra2: pointer to row*
+    uint64_t* ptrWordIn = rowIn;       //In Lyra2: pointer to prev
+    uint64_t* ptrWordOut = rowOut;     //In Lyra2: pointer to row
+    __m128i v[8], in[6], col[6], rot[6];
+    uint64_t i;
+    LOAD_STATE(v, state);
+    for (i = 0; i < nCols; i++) {
+        //Absorbing "M[prev] [+] M[row*]"
+        LOAD_COLUMN(in, ptrWordIn);
+        LOAD_COLUMN(col, ptrWordInOut);
+        COLUMN_OP(in, _mm_add_epi64, col);
+        COLUMN_OP(v, _mm_xor_si128, in);
+        roundLyraSSE2(v);
+        //M[rowOut][col] = M[rowOut][col] XOR rand
+        LOAD_COLUMN(col, ptrWordOut);
+        STORE_COLUMN_OP(ptrWordOut, _mm_xor_si128, col, v);
+        //M[rowInOut][col] = M[rowInOut][col] XOR rotW(rand); rowInOut may be rowOut, so it is reloaded
+        LOAD_COLUMN(col, ptrWordInOut);
+        ROTW(rot, v);
+        STORE_COLUMN_OP(ptrWordInOut, _mm_xor_si128, col, rot);
+        //Goes to next block
+        ptrWordOut += BLOCK_LEN_INT64;
+        ptrWordInOut += BLOCK_LEN_INT64;
+        ptrWordIn += BLOCK_LEN_INT64;
+    }
+    STORE_STATE(state, v);
+}
+
+const spongeImpl spongeSSE2 = {
+    absorbBlockSSE2,
+    absorbBlockBlake2SafeSSE2,
+    reducedSqueezeRow0SSE2,
+    reducedDuplexRow1SSE2,
+    reducedDuplexRowSetupSSE2,
+    reducedDuplexRowSSE2
+};
+
+#endif /* __SSE2__ */
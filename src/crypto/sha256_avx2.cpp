@@ -0,0 +1,166 @@
+// Copyright (c) 2018 The NPSCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// Eight-way parallel double-SHA256 of 64-byte inputs, one input per 32-bit lane.
+// This file is compiled with AVX2 code generation enabled and must only be
+// called after checking that the CPU supports it (see SHA256AutoDetect()).
+
+#if defined(__AVX2__)
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "crypto/common.h"
+
+namespace sha256d64_avx2 {
+namespace {
+
+__m256i inline K(uint32_t x) { return _mm256_set1_epi32(x); }
+
+__m256i inline Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+__m256i inline Add(__m256i x, __m256i y, __m256i z) { return Add(Add(x, y), z); }
+__m256i inline Add(__m256i x, __m256i y, __m256i z, __m256i w) { return Add(Add(x, y), Add(z, w)); }
+__m256i inline Inc(__m256i& x, __m256i y) { x = Add(x, y); return x; }
+__m256i inline Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+__m256i inline Xor(__m256i x, __m256i y, __m256i z) { return Xor(Xor(x, y), z); }
+__m256i inline Or(__m256i x, __m256i y) { return _mm256_or_si256(x, y); }
+__m256i inline And(__m256i x, __m256i y) { return _mm256_and_si256(x, y); }
+__m256i inline ShR(__m256i x, int n) { return _mm256_srli_epi32(x, n); }
+__m256i inline ShL(__m256i x, int n) { return _mm256_slli_epi32(x, n); }
+__m256i inline Rotr(__m256i x, int n) { return Or(ShR(x, n), ShL(x, 32 - n)); }
+
+__m256i inline Ch(__m256i x, __m256i y, __m256i z) { return Xor(z, And(x, Xor(y, z))); }
+__m256i inline Maj(__m256i x, __m256i y, __m256i z) { return Or(And(x, y), And(z, Or(x, y))); }
+__m256i inline Sigma0(__m256i x) { return Xor(Rotr(x, 2), Rotr(x, 13), Rotr(x, 22)); }
+__m256i inline Sigma1(__m256i x) { return Xor(Rotr(x, 6), Rotr(x, 11), Rotr(x, 25)); }
+__m256i inline sigma0(__m256i x) { return Xor(Rotr(x, 7), Rotr(x, 18), ShR(x, 3)); }
+__m256i inline sigma1(__m256i x) { return Xor(Rotr(x, 17), Rotr(x, 19), ShR(x, 10)); }
+
+/** One round of SHA-256, k being the round constant already added to the message word. */
+void inline __attribute__((always_inline)) Round(__m256i a, __m256i b, __m256i c, __m256i& d, __m256i e, __m256i f, __m256i g, __m256i& h, __m256i k)
+{
+    __m256i t1 = Add(h, Sigma1(e), Ch(e, f, g), k);
+    __m256i t2 = Add(Sigma0(a), Maj(a, b, c));
+    d = Add(d, t1);
+    h = Add(t1, t2);
+}
+
+const uint32_t ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/** Perform one SHA-256 transformation on eight lanes; w is clobbered. */
+void inline __attribute__((always_inline)) Transform(__m256i* s, __m256i* w)
+{
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+    for (int j = 0; j < 64; j += 16) {
+        if (j) {
+            for (int i = 0; i < 16; i++) {
+                Inc(w[i], Add(sigma1(w[(i + 14) & 15]), w[(i + 9) & 15], sigma0(w[(i + 1) & 15])));
+            }
+        }
+        Round(a, b, c, d, e, f, g, h, Add(K(ROUND_CONSTANTS[j + 0]), w[0]));
+        Round(h, a, b, c, d, e, f, g, Add(K(ROUND_CONSTANTS[j + 1]), w[1]));
+        Round(g, h, a, b, c, d, e, f, Add(K(ROUND_CONSTANTS[j + 2]), w[2]));
+        Round(f, g, h, a, b, c, d, e, Add(K(ROUND_CONSTANTS[j + 3]), w[3]));
+        Round(e, f, g, h, a, b, c, d, Add(K(ROUND_CONSTANTS[j + 4]), w[4]));
+        Round(d, e, f, g, h, a, b, c, Add(K(ROUND_CONSTANTS[j + 5]), w[5]));
+        Round(c, d, e, f, g, h, a, b, Add(K(ROUND_CONSTANTS[j + 6]), w[6]));
+        Round(b, c, d, e, f, g, h, a, Add(K(ROUND_CONSTANTS[j + 7]), w[7]));
+        Round(a, b, c, d, e, f, g, h, Add(K(ROUND_CONSTANTS[j + 8]), w[8]));
+        Round(h, a, b, c, d, e, f, g, Add(K(ROUND_CONSTANTS[j + 9]), w[9]));
+        Round(g, h, a, b, c, d, e, f, Add(K(ROUND_CONSTANTS[j + 10]), w[10]));
+        Round(f, g, h, a, b, c, d, e, Add(K(ROUND_CONSTANTS[j + 11]), w[11]));
+        Round(e, f, g, h, a, b, c, d, Add(K(ROUND_CONSTANTS[j + 12]), w[12]));
+        Round(d, e, f, g, h, a, b, c, Add(K(ROUND_CONSTANTS[j + 13]), w[13]));
+        Round(c, d, e, f, g, h, a, b, Add(K(ROUND_CONSTANTS[j + 14]), w[14]));
+        Round(b, c, d, e, f, g, h, a, Add(K(ROUND_CONSTANTS[j + 15]), w[15]));
+    }
+
+    Inc(s[0], a);
+    Inc(s[1], b);
+    Inc(s[2], c);
+    Inc(s[3], d);
+    Inc(s[4], e);
+    Inc(s[5], f);
+    Inc(s[6], g);
+    Inc(s[7], h);
+}
+
+void inline Initialize(__m256i* s)
+{
+    s[0] = K(0x6a09e667ul);
+    s[1] = K(0xbb67ae85ul);
+    s[2] = K(0x3c6ef372ul);
+    s[3] = K(0xa54ff53aul);
+    s[4] = K(0x510e527ful);
+    s[5] = K(0x9b05688cul);
+    s[6] = K(0x1f83d9abul);
+    s[7] = K(0x5be0cd19ul);
+}
+
+/** Load the big endian word at the given offset of each of the eight 64-byte inputs. */
+__m256i inline Read8(const unsigned char* chunk, int offset)
+{
+    return _mm256_set_epi32(ReadBE32(chunk + 448 + offset), ReadBE32(chunk + 384 + offset), ReadBE32(chunk + 320 + offset), ReadBE32(chunk + 256 + offset),
+                            ReadBE32(chunk + 192 + offset), ReadBE32(chunk + 128 + offset), ReadBE32(chunk + 64 + offset), ReadBE32(chunk + offset));
+}
+
+/** Store a word of each lane, big endian, at the given offset of each of the eight 32-byte outputs. */
+void inline Write8(unsigned char* out, int offset, __m256i v)
+{
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, v);
+    for (int i = 0; i < 8; i++) {
+        WriteBE32(out + 32 * i + offset, lanes[i]);
+    }
+}
+
+}
+
+void Transform_8way(unsigned char* out, const unsigned char* in)
+{
+    __m256i s[8], t[8], w[16];
+
+    // First hash: the 64-byte inputs, then a padding block for a 512-bit message
+    Initialize(s);
+    for (int i = 0; i < 16; i++) {
+        w[i] = Read8(in, 4 * i);
+    }
+    Transform(s, w);
+    w[0] = K(0x80000000ul);
+    for (int i = 1; i < 15; i++) {
+        w[i] = K(0);
+    }
+    w[15] = K(0x200);
+    Transform(s, w);
+
+    // Second hash: the 32-byte digests plus padding for a 256-bit message
+    Initialize(t);
+    for (int i = 0; i < 8; i++) {
+        w[i] = s[i];
+    }
+    w[8] = K(0x80000000ul);
+    for (int i = 9; i < 15; i++) {
+        w[i] = K(0);
+    }
+    w[15] = K(0x100);
+    Transform(t, w);
+
+    for (int i = 0; i < 8; i++) {
+        Write8(out, 4 * i, t[i]);
+    }
+}
+
+}
+
+#endif
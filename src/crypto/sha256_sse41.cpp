@@ -0,0 +1,164 @@
+// Copyright (c) 2018 The NPSCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// Four-way parallel double-SHA256 of 64-byte inputs, one input per 32-bit lane.
+// This file is compiled with SSE4.1 code generation enabled and must only be
+// called after checking that the CPU supports it (see SHA256AutoDetect()).
+
+#if defined(__SSE4_1__)
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "crypto/common.h"
+
+namespace sha256d64_sse41 {
+namespace {
+
+__m128i inline K(uint32_t x) { return _mm_set1_epi32(x); }
+
+__m128i inline Add(__m128i x, __m128i y) { return _mm_add_epi32(x, y); }
+__m128i inline Add(__m128i x, __m128i y, __m128i z) { return Add(Add(x, y), z); }
+__m128i inline Add(__m128i x, __m128i y, __m128i z, __m128i w) { return Add(Add(x, y), Add(z, w)); }
+__m128i inline Inc(__m128i& x, __m128i y) { x = Add(x, y); return x; }
+__m128i inline Xor(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
+__m128i inline Xor(__m128i x, __m128i y, __m128i z) { return Xor(Xor(x, y), z); }
+__m128i inline Or(__m128i x, __m128i y) { return _mm_or_si128(x, y); }
+__m128i inline And(__m128i x, __m128i y) { return _mm_and_si128(x, y); }
+__m128i inline ShR(__m128i x, int n) { return _mm_srli_epi32(x, n); }
+__m128i inline ShL(__m128i x, int n) { return _mm_slli_epi32(x, n); }
+__m128i inline Rotr(__m128i x, int n) { return Or(ShR(x, n), ShL(x, 32 - n)); }
+
+__m128i inline Ch(__m128i x, __m128i y, __m128i z) { return Xor(z, And(x, Xor(y, z))); }
+__m128i inline Maj(__m128i x, __m128i y, __m128i z) { return Or(And(x, y), And(z, Or(x, y))); }
+__m128i inline Sigma0(__m128i x) { return Xor(Rotr(x, 2), Rotr(x, 13), Rotr(x, 22)); }
+__m128i inline Sigma1(__m128i x) { return Xor(Rotr(x, 6), Rotr(x, 11), Rotr(x, 25)); }
+__m128i inline sigma0(__m128i x) { return Xor(Rotr(x, 7), Rotr(x, 18), ShR(x, 3)); }
+__m128i inline sigma1(__m128i x) { return Xor(Rotr(x, 17), Rotr(x, 19), ShR(x, 10)); }
+
+/** One round of SHA-256, k being the round constant already added to the message word. */
+void inline __attribute__((always_inline)) Round(__m128i a, __m128i b, __m128i c, __m128i& d, __m128i e, __m128i f, __m128i g, __m128i& h, __m128i k)
+{
+    __m128i t1 = Add(h, Sigma1(e), Ch(e, f, g), k);
+    __m128i t2 = Add(Sigma0(a), Maj(a, b, c));
+    d = Add(d, t1);
+    h = Add(t1, t2);
+}
+
+const uint32_t ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/** Perform one SHA-256 transformation on four lanes; w is clobbered. */
+void inline __attribute__((always_inline)) Transform(__m128i* s, __m128i* w)
+{
+    __m128i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+    for (int j = 0; j < 64; j += 16) {
+        if (j) {
+            for (int i = 0; i < 16; i++) {
+                Inc(w[i], Add(sigma1(w[(i + 14) & 15]), w[(i + 9) & 15], sigma0(w[(i + 1) & 15])));
+            }
+        }
+        Round(a, b, c, d, e, f, g, h, Add(K(ROUND_CONSTANTS[j + 0]), w[0]));
+        Round(h, a, b, c, d, e, f, g, Add(K(ROUND_CONSTANTS[j + 1]), w[1]));
+        Round(g, h, a, b, c, d, e, f, Add(K(ROUND_CONSTANTS[j + 2]), w[2]));
+        Round(f, g, h, a, b, c, d, e, Add(K(ROUND_CONSTANTS[j + 3]), w[3]));
+        Round(e, f, g, h, a, b, c, d, Add(K(ROUND_CONSTANTS[j + 4]), w[4]));
+        Round(d, e, f, g, h, a, b, c, Add(K(ROUND_CONSTANTS[j + 5]), w[5]));
+        Round(c, d, e, f, g, h, a, b, Add(K(ROUND_CONSTANTS[j + 6]), w[6]));
+        Round(b, c, d, e, f, g, h, a, Add(K(ROUND_CONSTANTS[j + 7]), w[7]));
+        Round(a, b, c, d, e, f, g, h, Add(K(ROUND_CONSTANTS[j + 8]), w[8]));
+        Round(h, a, b, c, d, e, f, g, Add(K(ROUND_CONSTANTS[j + 9]), w[9]));
+        Round(g, h, a, b, c, d, e, f, Add(K(ROUND_CONSTANTS[j + 10]), w[10]));
+        Round(f, g, h, a, b, c, d, e, Add(K(ROUND_CONSTANTS[j + 11]), w[11]));
+        Round(e, f, g, h, a, b, c, d, Add(K(ROUND_CONSTANTS[j + 12]), w[12]));
+        Round(d, e, f, g, h, a, b, c, Add(K(ROUND_CONSTANTS[j + 13]), w[13]));
+        Round(c, d, e, f, g, h, a, b, Add(K(ROUND_CONSTANTS[j + 14]), w[14]));
+        Round(b, c, d, e, f, g, h, a, Add(K(ROUND_CONSTANTS[j + 15]), w[15]));
+    }
+
+    Inc(s[0], a);
+    Inc(s[1], b);
+    Inc(s[2], c);
+    Inc(s[3], d);
+    Inc(s[4], e);
+    Inc(s[5], f);
+    Inc(s[6], g);
+    Inc(s[7], h);
+}
+
+void inline Initialize(__m128i* s)
+{
+    s[0] = K(0x6a09e667ul);
+    s[1] = K(0xbb67ae85ul);
+    s[2] = K(0x3c6ef372ul);
+    s[3] = K(0xa54ff53aul);
+    s[4] = K(0x510e527ful);
+    s[5] = K(0x9b05688cul);
+    s[6] = K(0x1f83d9abul);
+    s[7] = K(0x5be0cd19ul);
+}
+
+/** Load the big endian word at the given offset of each of the four 64-byte inputs. */
+__m128i inline Read4(const unsigned char* chunk, int offset)
+{
+    return _mm_set_epi32(ReadBE32(chunk + 192 + offset), ReadBE32(chunk + 128 + offset), ReadBE32(chunk + 64 + offset), ReadBE32(chunk + offset));
+}
+
+/** Store a word of each lane, big endian, at the given offset of each of the four 32-byte outputs. */
+void inline Write4(unsigned char* out, int offset, __m128i v)
+{
+    WriteBE32(out + offset, _mm_extract_epi32(v, 0));
+    WriteBE32(out + 32 + offset, _mm_extract_epi32(v, 1));
+    WriteBE32(out + 64 + offset, _mm_extract_epi32(v, 2));
+    WriteBE32(out + 96 + offset, _mm_extract_epi32(v, 3));
+}
+
+}
+
+void Transform_4way(unsigned char* out, const unsigned char* in)
+{
+    __m128i s[8], t[8], w[16];
+
+    // First hash: the 64-byte inputs, then a padding block for a 512-bit message
+    Initialize(s);
+    for (int i = 0; i < 16; i++) {
+        w[i] = Read4(in, 4 * i);
+    }
+    Transform(s, w);
+    w[0] = K(0x80000000ul);
+    for (int i = 1; i < 15; i++) {
+        w[i] = K(0);
+    }
+    w[15] = K(0x200);
+    Transform(s, w);
+
+    // Second hash: the 32-byte digests plus padding for a 256-bit message
+    Initialize(t);
+    for (int i = 0; i < 8; i++) {
+        w[i] = s[i];
+    }
+    w[8] = K(0x80000000ul);
+    for (int i = 9; i < 15; i++) {
+        w[i] = K(0);
+    }
+    w[15] = K(0x100);
+    Transform(t, w);
+
+    for (int i = 0; i < 8; i++) {
+        Write4(out, 4 * i, t[i]);
+    }
+}
+
+}
+
+#endif
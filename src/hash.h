@@ -15,36 +15,14 @@
 #include "uint256.h"
 #include "version.h"
 
-#include "crypto/sph_blake.h"
-#include "crypto/Lyra2Z.h"
-#include "crypto/Lyra2.h"
-
-
+#include "crypto/Lyra2Z/sph_blake.h"
+#include "crypto/Lyra2Z/Lyra2Z.h"
+#include "crypto/Lyra2Z/Lyra2.h"
 
 #include <vector>
 
 typedef uint256 ChainCode;
 
-#ifdef GLOBALDEFINED
-#define GLOBAL
-#else
-#define GLOBAL extern
-#endif
-
-GLOBAL sph_blake256_context     z_blake;
-
-
-
-#define fillz() do { \
-    sph_blake256_init(&z_blake); \
-} while (0)
-
-
-#define ZBLAKE256 (memcpy(&ctx_blake, &z_blake, sizeof(z_blake)))
-
-
-
-
 /* ----------- Bitcoin Hash ------------------------------------------------- */
 /** A hasher class for Bitcoin's 256-bit hash (double SHA-256). */
 class CHash256 {
@@ -79,6 +79,36 @@ static void JSONErrorReply(HTTPRequest* req, const UniValue& objError, const Uni
     req->WriteReply(nStatus, strReply);
 }
 
+static bool DeferredRPCWoken(uint64_t nWakes)
+{
+    return GetDeferredRPCWakes() != nWakes;
+}
+
+static void ParkJSONRPC(HTTPRequest* req, const UniValue& id, const JSONRPCDeferred& deferred);
+
+/** Answer a deferred call once it is woken up, or park it again */
+static void HTTPReq_JSONRPCResume(HTTPRequest* req, const UniValue& id, const boost::function<UniValue ()>& fnResume)
+{
+    try {
+        UniValue result = fnResume();
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, JSONRPCReply(result, NullUniValue, id));
+    } catch (const JSONRPCDeferred& deferred) {
+        ParkJSONRPC(req, id, deferred);
+    } catch (const UniValue& objError) {
+        JSONErrorReply(req, objError, id);
+    } catch (const std::exception& e) {
+        JSONErrorReply(req, JSONRPCError(RPC_MISC_ERROR, e.what()), id);
+    }
+}
+
+/** Put a deferred call aside without holding the worker thread */
+static void ParkJSONRPC(HTTPRequest* req, const UniValue& id, const JSONRPCDeferred& deferred)
+{
+    req->Park(deferred.nTimeout, boost::bind(&HTTPReq_JSONRPCResume, _1, id, deferred.fnResume),
+              boost::bind(&DeferredRPCWoken, deferred.nWakes));
+}
+
 //This function checks username and password against -rpcauth
 //entries from config file.
 static bool multiUserAuthorized(std::string strUserPass)
@@ -180,7 +210,13 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
         if (valRequest.isObject()) {
             jreq.parse(valRequest);
 
-            UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
+            UniValue result;
+            try {
+                result = tableRPC.execute(jreq.strMethod, jreq.params, true);
+            } catch (const JSONRPCDeferred& deferred) {
+                ParkJSONRPC(req, jreq.id, deferred);
+                return true;
+            }
 
             // Send reply
             strReply = JSONRPCReply(result, NullUniValue, jreq.id);
@@ -228,6 +264,7 @@ bool StartHTTPRPC()
         return false;
 
     RegisterHTTPHandler("/", true, HTTPReq_JSONRPC);
+    RPCServer::OnWakeDeferred(&WakeParkedHTTPRequests);
 
     assert(EventBase());
     httpRPCTimerInterface = new HTTPRPCTimerInterface(EventBase());
@@ -41,6 +41,40 @@
 /** Maximum size of http request (request line + headers) */
 static const size_t MAX_HEADERS_SIZE = 8192;
 
+/** Requests put aside by HTTPRequest::Park until they are woken up or time out */
+class HTTPParkedRequests
+{
+private:
+    struct Entry {
+        HTTPRequest* req;
+        HTTPEvent* timer;
+    };
+
+    boost::mutex mutex;
+    std::map<uint64_t, Entry> entries;
+    uint64_t nNextId;
+    //! no more requests get parked once the server is shutting down
+    bool fInterrupted;
+
+    void Add(HTTPRequest* req);
+    void OnTimeout(uint64_t id);
+    static void Resume(HTTPRequest* req);
+
+public:
+    HTTPParkedRequests() : nNextId(0), fInterrupted(false) {}
+
+    /** Take the request over if its handler parked it */
+    void AddIfParked(std::unique_ptr<HTTPRequest>& req);
+    /** Run the resume function of a parked request, see HTTPRequest::Park */
+    void RunResume(std::unique_ptr<HTTPRequest>& req);
+    void Wake(uint64_t id);
+    void WakeAll();
+    /** Answer all parked requests, and any that get parked later, with nStatus; for shutdown */
+    void ReplyAll(int nStatus);
+};
+
+static HTTPParkedRequests parkedRequests;
+
 /** HTTP request work item */
 class HTTPWorkItem : public HTTPClosure
 {
@@ -52,15 +86,32 @@ public:
     void operator()()
     {
         func(req.get(), path);
+        parkedRequests.AddIfParked(req);
     }
 
-    boost::scoped_ptr<HTTPRequest> req;
+    std::unique_ptr<HTTPRequest> req;
 
 private:
     std::string path;
     HTTPRequestHandler func;
 };
 
+/** Work item resuming a parked request */
+class HTTPResumeItem : public HTTPClosure
+{
+public:
+    HTTPResumeItem(HTTPRequest* req): req(req)
+    {
+    }
+    void operator()()
+    {
+        parkedRequests.RunResume(req);
+    }
+
+private:
+    std::unique_ptr<HTTPRequest> req;
+};
+
 /** Simple work queue for distributing work over multiple threads.
  * Work items are simply callable objects.
  */
@@ -111,11 +162,11 @@ public:
             queue.pop_front();
         }
     }
-    /** Enqueue a work item */
-    bool Enqueue(WorkItem* item)
+    /** Enqueue a work item; fLimit is false for parked requests, which got in before */
+    bool Enqueue(WorkItem* item, bool fLimit = true)
     {
         boost::unique_lock<boost::mutex> lock(cs);
-        if (queue.size() >= maxDepth) {
+        if (fLimit && queue.size() >= maxDepth) {
             return false;
         }
         queue.push_back(item);
@@ -475,6 +526,7 @@ void InterruptHTTPServer()
     }
     if (workQueue)
         workQueue->Interrupt();
+    parkedRequests.ReplyAll(HTTP_SERVUNAVAIL);
 }
 
 void StopHTTPServer()
@@ -551,8 +603,129 @@ void HTTPEvent::trigger(struct timeval* tv)
     else
         evtimer_add(ev, tv); // trigger after timeval passed
 }
+
+void HTTPParkedRequests::AddIfParked(std::unique_ptr<HTTPRequest>& req)
+{
+    if (req->fnResume)
+        Add(req.release());
+}
+
+void HTTPParkedRequests::RunResume(std::unique_ptr<HTTPRequest>& req)
+{
+    boost::function<void(HTTPRequest*)> fnResume;
+    fnResume.swap(req->fnResume);
+    fnResume(req.get());
+    AddIfParked(req);
+}
+
+void HTTPParkedRequests::Add(HTTPRequest* req)
+{
+    // Once in the map the request may be resumed by another thread any time
+    const int64_t nTimeout = req->nParkTimeout;
+    boost::function<bool(void)> fnWoken;
+    fnWoken.swap(req->fnWoken);
+
+    uint64_t id;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fInterrupted) {
+            req->fnResume.clear();
+            req->WriteReply(HTTP_SERVUNAVAIL);
+            delete req;
+            return;
+        }
+        id = nNextId++;
+        Entry entry = {req, new HTTPEvent(eventBase, false, boost::bind(&HTTPParkedRequests::OnTimeout, this, id))};
+        struct timeval tv;
+        tv.tv_sec = nTimeout / 1000;
+        tv.tv_usec = (nTimeout % 1000) * 1000;
+        entry.timer->trigger(&tv);
+        entries.insert(std::make_pair(id, entry));
+    }
+    LogPrint("http", "Parked request %d for %d ms\n", id, nTimeout);
+    // The request was not in the map yet when this wake up came in
+    if (fnWoken && fnWoken())
+        Wake(id);
+}
+
+void HTTPParkedRequests::OnTimeout(uint64_t id)
+{
+    Entry entry;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<uint64_t, Entry>::iterator it = entries.find(id);
+        if (it == entries.end())
+            return;
+        entry = it->second;
+        entries.erase(it);
+    }
+    // Runs in the timer's own callback, which frees it afterwards
+    entry.timer->deleteWhenTriggered = true;
+    Resume(entry.req);
+}
+
+void HTTPParkedRequests::Resume(HTTPRequest* req)
+{
+    HTTPResumeItem* item = new HTTPResumeItem(req);
+    assert(workQueue);
+    workQueue->Enqueue(item, false);
+}
+
+void HTTPParkedRequests::Wake(uint64_t id)
+{
+    Entry entry;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<uint64_t, Entry>::iterator it = entries.find(id);
+        if (it == entries.end())
+            return;
+        entry = it->second;
+        entries.erase(it);
+    }
+    // Outside of our lock, as this waits for a running timeout callback
+    delete entry.timer;
+    Resume(entry.req);
+}
+
+void HTTPParkedRequests::WakeAll()
+{
+    std::map<uint64_t, Entry> woken;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        woken.swap(entries);
+    }
+    if (!woken.empty())
+        LogPrint("http", "Waking %u parked requests\n", woken.size());
+    for (std::map<uint64_t, Entry>::iterator it = woken.begin(); it != woken.end(); ++it) {
+        delete it->second.timer;
+        Resume(it->second.req);
+    }
+}
+
+void HTTPParkedRequests::ReplyAll(int nStatus)
+{
+    std::map<uint64_t, Entry> parked;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fInterrupted = true;
+        parked.swap(entries);
+    }
+    for (std::map<uint64_t, Entry>::iterator it = parked.begin(); it != parked.end(); ++it) {
+        delete it->second.timer;
+        it->second.req->fnResume.clear();
+        it->second.req->WriteReply(nStatus);
+        delete it->second.req;
+    }
+}
+
+void WakeParkedHTTPRequests()
+{
+    parkedRequests.WakeAll();
+}
+
 HTTPRequest::HTTPRequest(struct evhttp_request* req) : req(req),
-                                                       replySent(false)
+                                                       replySent(false),
+                                                       nParkTimeout(0)
 {
 }
 HTTPRequest::~HTTPRequest()
@@ -622,6 +795,14 @@ void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
     req = 0; // transferred back to main thread
 }
 
+void HTTPRequest::Park(int64_t nTimeout, const boost::function<void(HTTPRequest*)>& fnResumeIn, const boost::function<bool(void)>& fnWokenIn)
+{
+    assert(!replySent && req);
+    nParkTimeout = std::max(nTimeout, (int64_t)0);
+    fnResume = fnResumeIn;
+    fnWoken = fnWokenIn;
+}
+
 CService HTTPRequest::GetPeer()
 {
     evhttp_connection* con = evhttp_request_get_connection(req);
@@ -44,6 +44,9 @@ void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPR
 /** Unregister handler for prefix */
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
 
+/** Run the parked HTTP requests again, see HTTPRequest::Park */
+void WakeParkedHTTPRequests();
+
 /** Return evhttp event base. This can be used by submodules to
  * queue timers or custom events.
  */
@@ -57,6 +60,12 @@ class HTTPRequest
 private:
     struct evhttp_request* req;
     bool replySent;
+    //! set by Park
+    int64_t nParkTimeout;
+    boost::function<void(HTTPRequest*)> fnResume;
+    boost::function<bool(void)> fnWoken;
+
+    friend class HTTPParkedRequests;
 
 public:
     HTTPRequest(struct evhttp_request* req);
@@ -112,6 +121,16 @@ public:
      * main thread, do not call any other HTTPRequest methods after calling this.
      */
     void WriteReply(int nStatus, const std::string& strReply = "");
+
+    /**
+     * Put the request aside once the handler returns, instead of replying.
+     * It waits without holding a worker thread until WakeParkedHTTPRequests
+     * is called or nTimeout milliseconds have passed, then fnResume is run
+     * on a worker thread and may reply or park the request again.
+     * fnWoken tells whether a wake up already came in before the request
+     * could be parked; the request is resumed right away then.
+     */
+    void Park(int64_t nTimeout, const boost::function<void(HTTPRequest*)>& fnResume, const boost::function<bool(void)>& fnWoken);
 };
 
 /** Event handler closure.
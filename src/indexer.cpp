@@ -0,0 +1,563 @@
+// Copyright (c) 2018 The NPSCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "indexer.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "coins.h"
+#include "init.h"
+#include "primitives/block.h"
+#include "txdb.h"
+#include "undo.h"
+#include "util.h"
+#include "validation.h"
+#include "validationinterface.h"
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <set>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+
+static std::atomic<int> nIndexesBuilding(0);
+static std::atomic<int> nIndexerHeight(-1);
+
+/** Extract the address type and hash of a P2SH or P2PKH script; returns 0 for other scripts */
+static int GetScriptAddress(const CScript& script, uint160& hashBytes)
+{
+    if (script.IsPayToScriptHash()) {
+        memcpy(hashBytes.begin(), &script[2], 20);
+        return 2;
+    }
+    if (script.IsPayToPublicKeyHash()) {
+        memcpy(hashBytes.begin(), &script[3], 20);
+        return 1;
+    }
+    hashBytes.SetNull();
+    return 0;
+}
+
+/**
+ * The change a block makes to the balances of the addresses it pays to or
+ * spends from. Disconnecting the block takes back the same change.
+ */
+static void GetBlockBalanceRecords(const CBlock& block, const CBlockUndo& blockundo, CIndexRecords& records)
+{
+    std::map<CAddressBalanceKey, CAddressBalance> mapBalance;
+    uint160 hashBytes;
+
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = *block.vtx[i];
+        std::vector<std::pair<CAddressBalanceKey, CAmount> > vChanges;
+
+        if (i > 0) {
+            const CTxUndo& txundo = blockundo.vtxundo[i-1];
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const CTxOut& out = txundo.vprevout[j].out;
+                int addressType = GetScriptAddress(out.scriptPubKey, hashBytes);
+                if (addressType > 0)
+                    vChanges.push_back(std::make_pair(CAddressBalanceKey(addressType, hashBytes), out.nValue * -1));
+            }
+        }
+        for (unsigned int k = 0; k < tx.vout.size(); k++) {
+            const CTxOut& out = tx.vout[k];
+            int addressType = GetScriptAddress(out.scriptPubKey, hashBytes);
+            if (addressType > 0)
+                vChanges.push_back(std::make_pair(CAddressBalanceKey(addressType, hashBytes), out.nValue));
+        }
+
+        // Count the transaction once for every address it touches
+        std::set<CAddressBalanceKey> setAddresses;
+        for (unsigned int n = 0; n < vChanges.size(); n++) {
+            CAddressBalance& balance = mapBalance[vChanges[n].first];
+            balance.balance += vChanges[n].second;
+            if (vChanges[n].second > 0)
+                balance.received += vChanges[n].second;
+            if (setAddresses.insert(vChanges[n].first).second)
+                balance.txCount++;
+        }
+    }
+
+    records.addressBalance.insert(records.addressBalance.end(), mapBalance.begin(), mapBalance.end());
+}
+
+void GetBlockIndexRecords(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex, int nIndexes, CIndexRecords& records)
+{
+    const bool fAddress = nIndexes & INDEX_ADDRESS;
+    const bool fSpent = nIndexes & INDEX_SPENT;
+    uint160 hashBytes;
+
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = *block.vtx[i];
+        const uint256 txhash = tx.GetHash();
+
+        if (i > 0 && (fAddress || fSpent)) {
+            const CTxUndo& txundo = blockundo.vtxundo[i-1];
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const COutPoint& prevout = tx.vin[j].prevout;
+                const CTxOut& out = txundo.vprevout[j].out;
+                int addressType = GetScriptAddress(out.scriptPubKey, hashBytes);
+
+                if (fAddress && addressType > 0) {
+                    // record spending activity
+                    records.addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, j, true), out.nValue * -1));
+
+                    // remove address from unspent index
+                    records.addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, prevout.hash, prevout.n), CAddressUnspentValue()));
+                }
+
+                if (fSpent) {
+                    // the txid and input that spent an output, with the amount and address it came from
+                    records.spentIndex.push_back(std::make_pair(CSpentIndexKey(prevout.hash, prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, out.nValue, addressType, hashBytes)));
+                }
+            }
+        }
+
+        if (fAddress) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut& out = tx.vout[k];
+                int addressType = GetScriptAddress(out.scriptPubKey, hashBytes);
+                if (addressType == 0)
+                    continue;
+
+                // record receiving activity
+                records.addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, k, false), out.nValue));
+
+                // record unspent output
+                records.addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+            }
+        }
+    }
+
+    if (nIndexes & INDEX_TIMESTAMP)
+        records.timestampIndex.push_back(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash()));
+
+    if (nIndexes & INDEX_ADDRESS_BALANCE)
+        GetBlockBalanceRecords(block, blockundo, records);
+}
+
+void GetBlockIndexUndoRecords(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex, int nIndexes, CIndexRecords& records)
+{
+    const bool fAddress = nIndexes & INDEX_ADDRESS;
+    const bool fSpent = nIndexes & INDEX_SPENT;
+    uint160 hashBytes;
+
+    // undo transactions in reverse order, so that outputs created and spent
+    // within the block end up erased from the unspent index
+    for (int i = block.vtx.size() - 1; i >= 0; i--) {
+        const CTransaction& tx = *block.vtx[i];
+        const uint256 txhash = tx.GetHash();
+
+        if (fAddress) {
+            for (unsigned int k = tx.vout.size(); k-- > 0;) {
+                const CTxOut& out = tx.vout[k];
+                int addressType = GetScriptAddress(out.scriptPubKey, hashBytes);
+                if (addressType == 0)
+                    continue;
+
+                // undo receiving activity
+                records.addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, k, false), out.nValue));
+
+                // undo unspent index
+                records.addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, txhash, k), CAddressUnspentValue()));
+            }
+        }
+
+        if (i > 0 && (fAddress || fSpent)) {
+            const CTxUndo& txundo = blockundo.vtxundo[i-1];
+            for (unsigned int j = tx.vin.size(); j-- > 0;) {
+                const COutPoint& prevout = tx.vin[j].prevout;
+                const Coin& coin = txundo.vprevout[j];
+                int addressType = GetScriptAddress(coin.out.scriptPubKey, hashBytes);
+
+                if (fSpent) {
+                    // undo and delete the spent index
+                    records.spentIndex.push_back(std::make_pair(CSpentIndexKey(prevout.hash, prevout.n), CSpentIndexValue()));
+                }
+
+                if (fAddress && addressType > 0) {
+                    // undo spending activity
+                    records.addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, j, true), coin.out.nValue * -1));
+
+                    // restore unspent index
+                    records.addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, prevout.hash, prevout.n), CAddressUnspentValue(coin.out.nValue, coin.out.scriptPubKey, coin.nHeight)));
+                }
+            }
+        }
+    }
+
+    // subtracted from the balances when written
+    if (nIndexes & INDEX_ADDRESS_BALANCE)
+        GetBlockBalanceRecords(block, blockundo, records);
+}
+
+/** Read a block of the active chain along with its undo data */
+static bool ReadBlockAndUndo(const CBlockIndex* pindex, CBlock& block, CBlockUndo& blockundo)
+{
+    if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus()))
+        return false;
+    CDiskBlockPos pos = pindex->GetUndoPos();
+    if (pos.IsNull())
+        return error("%s: no undo data available for block %s", __func__, pindex->GetBlockHash().ToString());
+    if (!UndoReadFromDisk(blockundo, pos, pindex->pprev->GetBlockHash()))
+        return false;
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+        return error("%s: block and undo data inconsistent for block %s", __func__, pindex->GetBlockHash().ToString());
+    return true;
+}
+
+/** Add the records of connecting or disconnecting a block to a batch */
+static void AddBlockRecords(const CBlockIndex* pindex, bool fConnect, int nIndexes, CIndexRecords& records)
+{
+    CBlock block;
+    CBlockUndo blockundo;
+    if (!ReadBlockAndUndo(pindex, block, blockundo))
+        throw std::runtime_error("failed to read block " + pindex->GetBlockHash().ToString());
+    if (fConnect)
+        GetBlockIndexRecords(block, blockundo, pindex, nIndexes, records);
+    else
+        GetBlockIndexUndoRecords(block, blockundo, pindex, nIndexes, records);
+}
+
+static void WriteRecords(CIndexRecords& records, bool fDisconnect, const CIndexBuildState& state, bool fBuilder)
+{
+    if (!pblocktree->WriteIndexRecords(records, fDisconnect, state, fBuilder))
+        throw std::runtime_error("failed to write index records");
+    records.clear();
+}
+
+/**
+ * Index the active chain from pindex up to its tip, taking back blocks that
+ * were reorganized away on the way. fnCaughtUp is called with cs_main held
+ * once everything up to the tip has been written, so no block can be
+ * connected before it returns.
+ */
+static void IndexActiveChain(const CBlockIndex* pindex, CIndexBuildState& state, bool fBuilder, const boost::function<void (const CBlockIndex*)>& fnCaughtUp)
+{
+    const int nIndexes = state.nIndexes;
+    CIndexRecords records;
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            const CBlockIndex* pindexNext;
+            {
+                LOCK(cs_main);
+                if (!chainActive.Contains(pindex)) {
+                    // The chain reorganized past the last indexed block: write out
+                    // what we have, then take that block back out of the indexes
+                    WriteRecords(records, false, state, fBuilder);
+                    if (nIndexes)
+                        AddBlockRecords(pindex, false, nIndexes, records);
+                    pindex = pindex->pprev;
+                    state.hashBlock = pindex->GetBlockHash();
+                    WriteRecords(records, true, state, fBuilder);
+                    continue;
+                }
+                pindexNext = chainActive.Next(pindex);
+                if (pindexNext == NULL) {
+                    WriteRecords(records, false, state, fBuilder);
+                    fnCaughtUp(pindex);
+                    return;
+                }
+            }
+
+            // Read and index the block outside of cs_main, so validation is not held up
+            if (nIndexes)
+                AddBlockRecords(pindexNext, true, nIndexes, records);
+            pindex = pindexNext;
+            state.hashBlock = pindex->GetBlockHash();
+            if (fBuilder)
+                nIndexerHeight = pindex->nHeight;
+
+            if (records.size() >= INDEXER_BATCH_RECORDS) {
+                WriteRecords(records, false, state, fBuilder);
+                LogPrint("index", "%s: indexed up to height %d\n", __func__, pindex->nHeight);
+            }
+        }
+    } catch (const boost::thread_interrupted&) {
+        // Keep what has been done so far, the next start resumes from there
+        if (!state.hashBlock.IsNull())
+            pblocktree->WriteIndexRecords(records, false, state, fBuilder);
+        LogPrintf("%s: interrupted at height %d\n", __func__, pindex->nHeight);
+        throw;
+    }
+}
+
+static void SwitchOnIndexes(int nIndexes, const CBlockIndex* pindexTip)
+{
+    AssertLockHeld(cs_main);
+    if (nIndexes & INDEX_ADDRESS) {
+        pblocktree->WriteFlag("addressindex", true);
+        fAddressIndex = true;
+    }
+    if (nIndexes & INDEX_SPENT) {
+        pblocktree->WriteFlag("spentindex", true);
+        fSpentIndex = true;
+    }
+    if (nIndexes & INDEX_TIMESTAMP) {
+        pblocktree->WriteFlag("timestampindex", true);
+        fTimestampIndex = true;
+    }
+    if (nIndexes & INDEX_ADDRESS_BALANCE) {
+        pblocktree->WriteFlag("addressbalanceindex", true);
+        fAddressBalanceIndex = true;
+    }
+    pblocktree->EraseIndexBuildState();
+    nIndexesBuilding = 0;
+    LogPrintf("%s: indexes 0x%x built up to height %d\n", __func__, nIndexes, pindexTip->nHeight);
+}
+
+static void ThreadIndexBuilder(int nIndexes)
+{
+    RenameThread("npscoin-idxbuild");
+
+    CIndexBuildState state(nIndexes);
+    const CBlockIndex* pindex = NULL;
+    {
+        LOCK(cs_main);
+        // Resume from the last batch written, unless it was building another set of indexes
+        CIndexBuildState stateStored;
+        if (pblocktree->ReadIndexBuildState(stateStored) && stateStored.nIndexes == nIndexes) {
+            BlockMap::iterator mi = mapBlockIndex.find(stateStored.hashBlock);
+            if (mi != mapBlockIndex.end()) {
+                pindex = mi->second;
+                state = stateStored;
+            }
+        }
+        // ConnectBlock never indexes the genesis block, so neither do we
+        if (pindex == NULL)
+            pindex = chainActive.Genesis();
+    }
+    LogPrintf("%s: building indexes 0x%x from height %d\n", __func__, nIndexes, pindex->nHeight);
+
+    try {
+        IndexActiveChain(pindex, state, true, boost::bind(&SwitchOnIndexes, nIndexes, _1));
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s, index building stopped\n", __func__, e.what());
+    }
+}
+
+/**
+ * Queue of blocks connected to and disconnected from the active chain, in
+ * the order the notifications came in, along with the indexes that were
+ * switched on at the time.
+ */
+class CIndexWriter : public CValidationInterface
+{
+public:
+    struct Entry {
+        const CBlockIndex* pindex;
+        bool fConnect;
+        int nIndexes;
+    };
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<Entry> queue;
+    //! number of entries queued and written since startup
+    uint64_t nQueued;
+    uint64_t nWritten;
+    bool fRunning;
+
+    void Push(const CBlockIndex* pindex, bool fConnect)
+    {
+        Entry entry = {pindex, fConnect, GetIndexesEnabled()};
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fRunning)
+            return;
+        queue.push_back(entry);
+        nQueued++;
+        cond.notify_all();
+    }
+
+protected:
+    void BlockConnected(const CBlock& block, const CBlockIndex* pindex) override { Push(pindex, true); }
+    void BlockDisconnected(const CBlock& block, const CBlockIndex* pindex) override { Push(pindex, false); }
+
+public:
+    CIndexWriter() : nQueued(0), nWritten(0), fRunning(false) {}
+
+    void SetRunning(bool fRunningIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = fRunningIn;
+        cond.notify_all();
+    }
+
+    /** Drop the queued entries, they are already accounted for */
+    void Clear()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queue.clear();
+        nWritten = nQueued;
+        cond.notify_all();
+    }
+
+    /** Take the next entry; waits for one unless fWait is false */
+    bool Pop(Entry& entry, bool fWait)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty()) {
+            if (!fWait)
+                return false;
+            cond.wait(lock);
+        }
+        entry = queue.front();
+        queue.pop_front();
+        return true;
+    }
+
+    /** Record that all entries taken so far have been written */
+    void SetWritten()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nWritten = nQueued - queue.size();
+        cond.notify_all();
+    }
+
+    void Sync()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        const uint64_t nTarget = nQueued;
+        while (fRunning && nWritten < nTarget)
+            cond.wait(lock);
+    }
+};
+
+static CIndexWriter indexWriter;
+
+static void ThreadIndexWriter()
+{
+    RenameThread("npscoin-idxwrite");
+
+    CIndexBuildState state(GetIndexesEnabled());
+    const CBlockIndex* pindex = NULL;
+    {
+        LOCK(cs_main);
+        // StartIndexer made sure there is a best block
+        CIndexBuildState stateStored;
+        if (pblocktree->ReadIndexBuildState(stateStored, false)) {
+            BlockMap::iterator mi = mapBlockIndex.find(stateStored.hashBlock);
+            if (mi != mapBlockIndex.end())
+                pindex = mi->second;
+        }
+        if (pindex == NULL) {
+            LogPrintf("%s: best block of the indexes not found\n", __func__);
+            indexWriter.SetRunning(false);
+            return;
+        }
+        if (pindex != chainActive.Tip())
+            LogPrintf("%s: catching up from height %d\n", __func__, pindex->nHeight);
+        state.hashBlock = pindex->GetBlockHash();
+    }
+
+    try {
+        // Catch up with blocks connected while the indexes were not being
+        // written; from the tip on the notifications take over
+        IndexActiveChain(pindex, state, false, boost::bind(&CIndexWriter::Clear, &indexWriter));
+
+        CIndexRecords records;
+        bool fDisconnect = false;
+        bool fDirty = false;
+        CIndexWriter::Entry entry;
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            // Write out a batch once it is large enough or the queue ran dry
+            if (!indexWriter.Pop(entry, !fDirty)) {
+                WriteRecords(records, fDisconnect, state, false);
+                fDirty = false;
+                indexWriter.SetWritten();
+                continue;
+            }
+            if ((!entry.fConnect != fDisconnect && !records.empty()) || records.size() >= INDEXER_BATCH_RECORDS)
+                WriteRecords(records, fDisconnect, state, false);
+            fDisconnect = !entry.fConnect;
+
+            if (entry.nIndexes)
+                AddBlockRecords(entry.pindex, entry.fConnect, entry.nIndexes, records);
+            state.nIndexes = entry.nIndexes;
+            state.hashBlock = entry.fConnect ? entry.pindex->GetBlockHash() : entry.pindex->pprev->GetBlockHash();
+            fDirty = true;
+        }
+    } catch (const boost::thread_interrupted&) {
+        indexWriter.SetRunning(false);
+        throw;
+    } catch (const std::exception& e) {
+        // The indexes would silently fall behind the chain, as failing to
+        // write them in ConnectBlock used to do, stop the node instead
+        LogPrintf("%s: %s, index writing stopped\n", __func__, e.what());
+        indexWriter.SetRunning(false);
+        StartShutdown();
+    }
+}
+
+int GetIndexesEnabled()
+{
+    return (fAddressIndex ? INDEX_ADDRESS : 0) | (fSpentIndex ? INDEX_SPENT : 0) | (fTimestampIndex ? INDEX_TIMESTAMP : 0) |
+           (fAddressBalanceIndex ? INDEX_ADDRESS_BALANCE : 0);
+}
+
+void StartIndexer(boost::thread_group& threadGroup)
+{
+    int nIndexes = 0;
+    if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) && !fAddressIndex)
+        nIndexes |= INDEX_ADDRESS;
+    // Address indexes from before the balances were kept get them built alongside
+    if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) && !fAddressBalanceIndex)
+        nIndexes |= INDEX_ADDRESS_BALANCE;
+    if (GetBoolArg("-spentindex", DEFAULT_SPENTINDEX) && !fSpentIndex)
+        nIndexes |= INDEX_SPENT;
+    if (GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX) && !fTimestampIndex)
+        nIndexes |= INDEX_TIMESTAMP;
+
+    // A reindex rewrites the indexes along with the chain
+    if (fReindex)
+        pblocktree->EraseIndexBuildState(false);
+
+    if (nIndexes == 0) {
+        // Forget about an index build that is not wanted anymore
+        pblocktree->EraseIndexBuildState();
+    } else {
+        nIndexesBuilding = nIndexes;
+        threadGroup.create_thread(boost::bind(&ThreadIndexBuilder, nIndexes));
+    }
+
+    if (GetIndexesEnabled() || nIndexes) {
+        LOCK(cs_main);
+        CIndexBuildState state(GetIndexesEnabled());
+        if (!pblocktree->ReadIndexBuildState(state, false)) {
+            // Without a best block the indexes were written along with the
+            // blocks, so they are up to date with the tip
+            state.hashBlock = chainActive.Tip()->GetBlockHash();
+            pblocktree->WriteIndexRecords(CIndexRecords(), false, state, false);
+        }
+        indexWriter.SetRunning(true);
+        RegisterValidationInterface(&indexWriter);
+        threadGroup.create_thread(&ThreadIndexWriter);
+    }
+}
+
+void StopIndexer()
+{
+    indexWriter.SetRunning(false);
+    UnregisterValidationInterface(&indexWriter);
+}
+
+int GetIndexesBuilding(int* pnHeight)
+{
+    if (pnHeight)
+        *pnHeight = nIndexerHeight;
+    return nIndexesBuilding;
+}
+
+void SyncWithIndexer()
+{
+    indexWriter.Sync();
+}
@@ -0,0 +1,56 @@
+// Copyright (c) 2018 The NPSCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEXER_H
+#define BITCOIN_INDEXER_H
+
+#include "spentindex.h"
+
+#include <boost/thread.hpp>
+
+class CBlock;
+class CBlockIndex;
+class CBlockUndo;
+
+/** Number of records the indexer collects before writing them out */
+static const size_t INDEXER_BATCH_RECORDS = 250000;
+
+/**
+ * Compute the records that connecting a block adds to the given indexes
+ * (INDEX_* flags). The outputs spent by the block are taken from its undo data.
+ * The balance index gets one record per address with the block's net change.
+ */
+void GetBlockIndexRecords(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex, int nIndexes, CIndexRecords& records);
+
+/**
+ * Compute the records that disconnecting a block erases from or restores to
+ * the given indexes. The timestamp index is left alone, as DisconnectBlock does;
+ * the balance changes are the same as when connecting and get subtracted.
+ */
+void GetBlockIndexUndoRecords(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex, int nIndexes, CIndexRecords& records);
+
+/** The indexes (INDEX_* flags) that are switched on and kept up to date with the chain */
+int GetIndexesEnabled();
+
+/**
+ * Start the index threads. Indexes that were requested with -addressindex,
+ * -spentindex or -timestampindex after the block database was created, and the
+ * address balances of an address index that predates them, are
+ * built by walking the active chain from where the builder last stopped;
+ * once it reaches the tip the index is switched on. Switched on indexes are
+ * written by a second thread, which follows the BlockConnected and
+ * BlockDisconnected notifications so that ConnectBlock does not have to.
+ */
+void StartIndexer(boost::thread_group& threadGroup);
+
+/** Stop following the chain; the index threads themselves end when the thread group is interrupted */
+void StopIndexer();
+
+/** The indexes (INDEX_* flags) still being built, and the height they have reached */
+int GetIndexesBuilding(int* pnHeight = NULL);
+
+/** Wait until the index records of all blocks connected so far have been written */
+void SyncWithIndexer();
+
+#endif // BITCOIN_INDEXER_H
@@ -95,6 +95,8 @@ public:
     void RejectLockRequest(const CTxLockRequest& txLockRequest);
     bool HasTxLockRequest(const uint256& txHash);
     bool GetTxLockRequest(const uint256& txHash, CTxLockRequest& txLockRequestRet);
+    // transactions of all known lock requests, e.g. to rebuild compact blocks from
+    void GetTxLockRequestTransactions(std::vector<std::pair<uint256, CTransactionRef> >& vtxRet);
 
     bool GetTxLockVote(const uint256& hash, CTxLockVote& txLockVoteRet);
 
@@ -120,7 +122,7 @@ public:
     std::string ToString();
 };
 
-class CTxLockRequest : public CTransaction
+class CTxLockRequest
 {
 private:
     static const CAmount MIN_FEE            = 0.0001 * COIN;
@@ -128,13 +130,37 @@ private:
 public:
     static const int WARN_MANY_INPUTS       = 100;
 
-    CTxLockRequest() = default;
-    CTxLockRequest(const CTransaction& tx) : CTransaction(tx) {};
+    // shared with the mempool and relay, not copied
+    CTransactionRef tx;
+
+    CTxLockRequest() : tx(MakeTransactionRef()) {};
+    CTxLockRequest(const CTransaction& txIn) : tx(MakeTransactionRef(txIn)) {};
+    CTxLockRequest(const CTransactionRef& txIn) : tx(txIn) {};
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(tx);
+    }
 
     bool IsValid() const;
     CAmount GetMinFee() const;
     int GetMaxSignatures() const;
 
+    const uint256& GetHash() const { return tx->GetHash(); }
+    std::string ToString() const { return tx->ToString(); }
+
+    friend bool operator==(const CTxLockRequest& a, const CTxLockRequest& b)
+    {
+        return *a.tx == *b.tx;
+    }
+
+    friend bool operator!=(const CTxLockRequest& a, const CTxLockRequest& b)
+    {
+        return !(a == b);
+    }
+
     explicit operator bool() const
     {
         return *this != CTxLockRequest();
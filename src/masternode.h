@@ -76,7 +76,11 @@ public:
     bool Sign(const CKey& keyMasternode, const CPubKey& pubKeyMasternode);
     bool CheckSignature(CPubKey& pubKeyMasternode, int &nDos);
     bool SimpleCheck(int& nDos);
+    // SimpleCheck() plus the age of the block hash, i.e. everything that needs cs_main
+    bool CheckBlockHash(int& nDos);
     bool CheckAndUpdate(CMasternode* pmn, bool fFromNewBroadcast, int& nDos, CConnman& connman);
+    // The rest of CheckAndUpdate() for a ping that passed CheckBlockHash(), doesn't wait for cs_main
+    bool Update(CMasternode* pmn, bool fFromNewBroadcast, int& nDos, CConnman& connman);
     void Relay(CConnman& connman);
 };
 
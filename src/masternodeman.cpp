@@ -779,11 +779,18 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         LogPrint("masternode", "MNPING -- Masternode ping, masternode=%s\n", mnp.vin.prevout.ToStringShort());
 
-        // Need LOCK2 here to ensure consistent locking order because the CheckAndUpdate call below locks cs_main
-        LOCK2(cs_main, cs);
+        {
+            LOCK(cs);
+            if(mapSeenMasternodePing.count(nHash)) return; //seen
+            mapSeenMasternodePing.insert(std::make_pair(nHash, mnp));
+        }
+
+        // Check the block hash on its own, cs_main must not be taken while cs
+        // is held and the rest of the ping (i.e. the signature) doesn't need it
+        int nDos = 0;
+        bool fBlockHashValid = mnp.CheckBlockHash(nDos);
 
-        if(mapSeenMasternodePing.count(nHash)) return; //seen
-        mapSeenMasternodePing.insert(std::make_pair(nHash, mnp));
+        LOCK(cs);
 
         LogPrint("masternode", "MNPING -- Masternode ping, masternode=%s new\n", mnp.vin.prevout.ToStringShort());
 
@@ -799,8 +806,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         // too late, new MNANNOUNCE is required
         if(pmn && pmn->IsNewStartRequired()) return;
 
-        int nDos = 0;
-        if(mnp.CheckAndUpdate(pmn, false, nDos, connman)) return;
+        if(fBlockHashValid && mnp.Update(pmn, false, nDos, connman)) return;
 
         if(nDos > 0) {
             // if anything significant failed, mark that node
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 
 #include <map>
+#include <memory>
 #include <set>
 #include <vector>
 #include <unordered_map>
@@ -108,6 +109,26 @@ static inline size_t IncrementalDynamicUsage(const std::map<X, Y, Z>& m)
     return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >));
 }
 
+// Shared pointers, allocated together with their control block by std::make_shared
+
+template<typename X>
+struct stl_shared_counter
+{
+    /* Various platforms use different sized counters here.
+     * Conservatively assume that they won't be larger than size_t. */
+    void* class_type;
+    size_t use_count;
+    size_t weak_count;
+    X x;
+};
+
+template<typename X>
+static inline size_t DynamicUsage(const std::shared_ptr<X>& p)
+{
+    // A shared object is counted in full by every holder, which errs on the side of overcounting
+    return p ? MallocUsage(sizeof(stl_shared_counter<X>)) : 0;
+}
+
 // Boost data structures
 
 template<typename X>
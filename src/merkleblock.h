@@ -67,11 +67,11 @@ protected:
         return (nTransactions+(1 << height)-1) >> height;
     }
 
-    /** calculate the hash of a node in the merkle tree (at leaf level: the txid's themselves) */
-    uint256 CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid);
+    /** look up the hash of a node in the merkle tree (at leaf level: the txid's themselves), in the levels computed by ComputeMerkleTree */
+    uint256 CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTree, const std::vector<size_t> &vLevel);
 
     /** recursive function that traverses tree nodes, storing the data as bits and hashes */
-    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
+    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTree, const std::vector<size_t> &vLevel, const std::vector<bool> &vMatch);
 
     /**
      * recursive function that traverses tree nodes, consuming the bits and hashes produced by TraverseAndBuild.
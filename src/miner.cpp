@@ -23,6 +23,7 @@
 #include "policy/policy.h"
 #include "pow.h"
 #include "primitives/transaction.h"
+#include "rpc/server.h"
 #include "script/standard.h"
 #include "timedata.h"
 #include "txmempool.h"
@@ -46,23 +47,12 @@ using namespace std;
 //
 // Unconfirmed transactions in the memory pool often depend on other
 // transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
+// pool, we select by highest priority or by the fee rate of a transaction
+// together with its unconfirmed ancestors, and add the ancestors first.
 
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 
-class ScoreCompare
-{
-public:
-    ScoreCompare() {}
-
-    bool operator()(const CTxMemPool::txiter a, const CTxMemPool::txiter b)
-    {
-        return CompareTxMemPoolEntryByScore()(*b,*a); // Convert to less than
-    }
-};
-
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     int64_t nOldTime = pblock->nTime;
@@ -78,257 +68,722 @@ int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParam
     return nNewTime - nOldTime;
 }
 
-CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn)
+BlockAssembler::BlockAssembler(const CChainParams& _chainparams)
+    : chainparams(_chainparams)
 {
-    // Create new block
-    std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to between 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MaxBlockSize(fDIP0001ActiveAtTip)-1000), nBlockMaxSize));
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+}
+
+void BlockAssembler::resetBlock()
+{
+    inBlock.clear();
+
+    // Reserve space for coinbase tx
+    nBlockSize = 1000;
+    nBlockSigOps = 100;
+
+    // These counters do not include coinbase tx
+    nBlockTx = 0;
+    nFees = 0;
+
+    lastFewTxs = 0;
+    blockFinished = false;
+}
+
+CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    resetBlock();
+
+    pblocktemplate.reset(new CBlockTemplate());
+
     if(!pblocktemplate.get())
         return NULL;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+    pblock = &pblocktemplate->block; // pointer for convenience
+
+    // Add dummy coinbase tx as first transaction
+    pblock->vtx.push_back(MakeTransactionRef());
+    pblocktemplate->vTxFees.push_back(-1); // updated at end
+    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+
+    LOCK2(cs_main, mempool.cs);
+
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    nHeight = pindexPrev->nHeight + 1;
 
-    // Create coinbase tx
+    pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
+    // -regtest only: allow overriding block.nVersion with
+    // -blockversion=N to test forking scenarios
+    if (chainparams.MineBlocksOnDemand())
+        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+
+    pblock->nTime = GetAdjustedTime();
+    const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
+
+    nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                       ? nMedianTimePast
+                       : pblock->GetBlockTime();
+
+    addPriorityTxs();
+    addPackageTxs();
+
+    nLastBlockTx = nBlockTx;
+    nLastBlockSize = nBlockSize;
+    LogPrintf("CreateNewBlock(): total size %u txs: %u fees: %ld sigops %d\n", nBlockSize, nBlockTx, nFees, nBlockSigOps);
+
+    // Create coinbase transaction.
     CMutableTransaction txNew;
     txNew.vin.resize(1);
     txNew.vin[0].prevout.SetNull();
     txNew.vout.resize(1);
     txNew.vout[0].scriptPubKey = scriptPubKeyIn;
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to between 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MaxBlockSize(fDIP0001ActiveAtTip)-1000), nBlockMaxSize));
+    // NOTE: unlike in bitcoin, we need to pass PREVIOUS block height here
+    CAmount blockReward = nFees + GetBlockSubsidy(pindexPrev->nBits, pindexPrev->nHeight, Params().GetConsensus());
+
+    // Compute regular coinbase transaction.
+    txNew.vout[0].nValue = blockReward;
+    txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+
+    // Founder Reward
+    CAmount founderReward = GetFounderPayment(nHeight);
+    if (founderReward > 0) {
+        CScript FOUNDER_SCRIPT = GetScriptForDestination(CBitcoinAddress(Params().FounderAddress()).Get());
+        txNew.vout[0].nValue -= founderReward;
+        txNew.vout.push_back(CTxOut(founderReward, CScript(FOUNDER_SCRIPT.begin(), FOUNDER_SCRIPT.end())));
+    }
+
+    // Update coinbase transaction with additional info about masternode and governance payments,
+    // get some info back to pass to getblocktemplate
+    FillBlockPayments(txNew, nHeight, blockReward, pblock->txoutMasternode, pblock->voutSuperblock);
+    // LogPrintf("CreateNewBlock -- nBlockHeight %d blockReward %lld txoutMasternode %s txNew %s",
+    //             nHeight, blockReward, pblock->txoutMasternode.ToString(), txNew.ToString());
+
+    // Update block coinbase
+    pblock->vtx[0] = MakeTransactionRef(std::move(txNew));
+    pblocktemplate->vTxFees[0] = -nFees;
+
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
+    pblock->nNonce         = 0;
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(*pblock->vtx[0]);
+
+    CValidationState state;
+    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+        throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+    }
+
+    return pblocktemplate.release();
+}
+
+bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
+{
+    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
+    {
+        if (!inBlock.count(parent)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
+{
+    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
+        // Only test txs not already in the block
+        if (inBlock.count(*iit)) {
+            testSet.erase(iit++);
+        }
+        else {
+            iit++;
+        }
+    }
+}
+
+bool BlockAssembler::TestPackage(uint64_t packageSize, unsigned int packageSigOps)
+{
+    if (nBlockSize + packageSize >= nBlockMaxSize)
+        return false;
+    if (nBlockSigOps + packageSigOps >= MaxBlockSigOps(fDIP0001ActiveAtTip))
+        return false;
+    return true;
+}
+
+// Block size and sigops have already been tested. Check that all transactions
+// are final.
+bool BlockAssembler::TestPackageFinality(const CTxMemPool::setEntries& package)
+{
+    BOOST_FOREACH (const CTxMemPool::txiter it, package) {
+        if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
+            return false;
+    }
+    return true;
+}
+
+bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
+{
+    if (nBlockSize + iter->GetTxSize() >= nBlockMaxSize) {
+        // If the block is so close to full that no more txs will fit
+        // or if we've tried more than 50 times to fill remaining space
+        // then flag that the block is finished
+        if (nBlockSize >  nBlockMaxSize - 100 || lastFewTxs > 50) {
+             blockFinished = true;
+             return false;
+        }
+        // Once we're within 1000 bytes of a full block, only look at 50 more txs
+        // to try to fill the remaining space.
+        if (nBlockSize > nBlockMaxSize - 1000) {
+            lastFewTxs++;
+        }
+        return false;
+    }
+
+    unsigned int nMaxBlockSigOps = MaxBlockSigOps(fDIP0001ActiveAtTip);
+    if (nBlockSigOps + iter->GetSigOpCount() >= nMaxBlockSigOps) {
+        // If the block has room for no more sig ops then
+        // flag that the block is finished
+        if (nBlockSigOps > nMaxBlockSigOps - 2) {
+            blockFinished = true;
+            return false;
+        }
+        // Otherwise attempt to find another tx with fewer sigops
+        // to put in the block.
+        return false;
+    }
+
+    // Must check that lock times are still valid
+    // This can be removed once MTP is always enforced
+    // as long as reorgs keep the mempool consistent.
+    if (!IsFinalTx(iter->GetTx(), nHeight, nLockTimeCutoff))
+        return false;
+
+    return true;
+}
+
+void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
+{
+    pblock->vtx.push_back(iter->GetSharedTx());
+    pblocktemplate->vTxFees.push_back(iter->GetFee());
+    pblocktemplate->vTxSigOps.push_back(iter->GetSigOpCount());
+    nBlockSize += iter->GetTxSize();
+    ++nBlockTx;
+    nBlockSigOps += iter->GetSigOpCount();
+    nFees += iter->GetFee();
+    inBlock.insert(iter);
+
+    bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
+    if (fPrintPriority) {
+        double dPriority = iter->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(iter->GetTx().GetHash(), dPriority, dummy);
+        LogPrintf("priority %.1f fee %s txid %s\n",
+                  dPriority,
+                  CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(),
+                  iter->GetTx().GetHash().ToString());
+    }
+}
+
+void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
+        indexed_modified_transaction_set &mapModifiedTx)
+{
+    BOOST_FOREACH(const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH(CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                modEntry.nSigOpCountWithAncestors -= it->GetSigOpCount();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
+
+// Skip entries in mapTx that are already in a block or are present
+// in mapModifiedTx (which implies that the mapTx ancestor state is
+// stale due to ancestor inclusion in the block)
+// Also skip transactions that we've already failed to add. This can happen if
+// we consider a transaction in mapModifiedTx and it fails: we can then
+// potentially consider it again while walking mapTx.  It's currently
+// guaranteed to fail again, but as a belt-and-suspenders check we put it in
+// failedTx and avoid re-evaluation, since the re-evaluation would be using
+// cached size/sigops/fee values that are not actually correct.
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx)
+{
+    assert (it != mempool.mapTx.end());
+    if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it))
+        return true;
+    return false;
+}
+
+void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries)
+{
+    // Sort package by ancestor count
+    // If a transaction A depends on transaction B, then A's ancestor count
+    // must be greater than B's.  So this is sufficient to validly order the
+    // transactions for block inclusion.
+    sortedEntries.clear();
+    sortedEntries.insert(sortedEntries.begin(), package.begin(), package.end());
+    std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+}
+
+// This transaction selection algorithm orders the mempool based
+// on feerate of a transaction including all unconfirmed ancestors.
+// Since we don't remove transactions from the mempool as we select them
+// for block inclusion, we need an alternate method of updating the feerate
+// of a transaction with its not-yet-selected ancestors as we go.
+// This is accomplished by walking the in-mempool descendants of selected
+// transactions and storing a temporary modified state in mapModifiedTxs.
+// Each time through the loop, we compare the best transaction in
+// mapModifiedTxs with the next transaction in the mempool to decide what
+// transaction package to work on next.
+void BlockAssembler::addPackageTxs()
+{
+    // mapModifiedTx will store sorted packages after they are modified
+    // because some of their txs are already in the block
+    indexed_modified_transaction_set mapModifiedTx;
+    // Keep track of entries that failed inclusion, to avoid duplicate work
+    CTxMemPool::setEntries failedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    // and modifying them for their already included ancestors
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::nth_index<4>::type::iterator mi = mempool.mapTx.get<4>().begin();
+    CTxMemPool::txiter iter;
+
+    // Limit the number of attempts to add transactions to the block when it is
+    // close to full; this is just a simple heuristic to finish quickly if the
+    // mempool has a lot of entries.
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    while (mi != mempool.mapTx.get<4>().end() || !mapModifiedTx.empty())
+    {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mempool.mapTx.get<4>().end() &&
+                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+
+        modtxscoreiter modit = mapModifiedTx.get<1>().begin();
+        if (mi == mempool.mapTx.get<4>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<1>().end() &&
+                    CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
+            }
+        }
+
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        unsigned int packageSigOps = iter->GetSigOpCountWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+            packageSigOps = modit->nSigOpCountWithAncestors;
+        }
+
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
+
+        if (!TestPackage(packageSize, packageSigOps)) {
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<1>().erase(modit);
+                failedTx.insert(iter);
+            }
+
+            ++nConsecutiveFailed;
+
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 1000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
+            }
+            continue;
+        }
 
+        CTxMemPool::setEntries ancestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+
+        onlyUnconfirmed(ancestors);
+        ancestors.insert(iter);
+
+        // Test if all tx's are Final
+        if (!TestPackageFinality(ancestors)) {
+            if (fUsingModified) {
+                mapModifiedTx.get<1>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
+
+        // This transaction will make it in; reset the failed counter.
+        nConsecutiveFailed = 0;
+
+        // Package can be added. Sort the entries in a valid order.
+        std::vector<CTxMemPool::txiter> sortedEntries;
+        SortForBlock(ancestors, iter, sortedEntries);
+
+        for (size_t i=0; i<sortedEntries.size(); ++i) {
+            AddToBlock(sortedEntries[i]);
+            // Erase from the modified set, if present
+            mapModifiedTx.erase(sortedEntries[i]);
+        }
+
+        // Update transactions that depend on each of these
+        UpdatePackagesForAdded(ancestors, mapModifiedTx);
+    }
+}
+
+void BlockAssembler::addPriorityTxs()
+{
     // How much of the block should be dedicated to high-priority transactions,
     // included regardless of the fees they pay
     unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
     nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
-    // Collect memory pool transactions into the block
-    CTxMemPool::setEntries inBlock;
-    CTxMemPool::setEntries waitSet;
+    if (nBlockPrioritySize == 0) {
+        return;
+    }
 
     // This vector will be sorted into a priority queue:
-    vector<TxCoinAgePriority> vecPriority;
+    std::vector<TxCoinAgePriority> vecPriority;
     TxCoinAgePriorityCompare pricomparer;
     std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
     typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
     double actualPriority = -1;
 
-    std::priority_queue<CTxMemPool::txiter, std::vector<CTxMemPool::txiter>, ScoreCompare> clearedTxs;
-    bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
-    uint64_t nBlockSize = 1000;
-    uint64_t nBlockTx = 0;
-    unsigned int nBlockSigOps = 100;
-    int lastFewTxs = 0;
-    CAmount nFees = 0;
-
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
     {
-        LOCK(cs_main);
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    CTxMemPool::txiter iter;
+    while (!vecPriority.empty() && !blockFinished) { // add a tx from priority queue to fill the blockprioritysize
+        iter = vecPriority.front().second;
+        actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        // If tx already in block, skip
+        if (inBlock.count(iter)) {
+            assert(false); // shouldn't happen for priority txs
+            continue;
+        }
 
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        pblock->nTime = GetAdjustedTime();
-        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
-
-        // Add our coinbase tx as first transaction
-        pblock->vtx.push_back(txNew);
-        pblocktemplate->vTxFees.push_back(-1); // updated at end
-        pblocktemplate->vTxSigOps.push_back(-1); // updated at end
-        pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
-        // -regtest only: allow overriding block.nVersion with
-        // -blockversion=N to test forking scenarios
-        if (chainparams.MineBlocksOnDemand())
-            pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
-
-        int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                ? nMedianTimePast
-                                : pblock->GetBlockTime();
+        // If tx is dependent on other mempool txs which haven't yet been included
+        // then put it in the waitSet
+        if (isStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
+        }
 
-        {
-            LOCK(mempool.cs);
+        // If this tx fits in the block add it, otherwise keep looping
+        if (TestForBlock(iter)) {
+            AddToBlock(iter);
 
-            bool fPriorityBlock = nBlockPrioritySize > 0;
-            if (fPriorityBlock) {
-                vecPriority.reserve(mempool.mapTx.size());
-                for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-                     mi != mempool.mapTx.end(); ++mi)
-                {
-                    double dPriority = mi->GetPriority(nHeight);
-                    CAmount dummy;
-                    mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
-                    vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
-                }
-                std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+            // If now that this txs is added we've surpassed our desired priority size
+            // or have dropped below the AllowFreeThreshold, then we're done adding priority txs
+            if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority)) {
+                break;
             }
 
-            CTxMemPool::indexed_transaction_set::nth_index<3>::type::iterator mi = mempool.mapTx.get<3>().begin();
-            CTxMemPool::txiter iter;
-
-            while (mi != mempool.mapTx.get<3>().end() || !clearedTxs.empty())
+            // This tx was successfully added, so
+            // add transactions that depend on this one to the priority queue to try again
+            BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
             {
-                bool priorityTx = false;
-                if (fPriorityBlock && !vecPriority.empty()) { // add a tx from priority queue to fill the blockprioritysize
-                    priorityTx = true;
-                    iter = vecPriority.front().second;
-                    actualPriority = vecPriority.front().first;
-                    std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
-                    vecPriority.pop_back();
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second,child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
                 }
-                else if (clearedTxs.empty()) { // add tx with next highest score
-                    iter = mempool.mapTx.project<0>(mi);
-                    mi++;
-                }
-                else {  // try to add a previously postponed child tx
-                    iter = clearedTxs.top();
-                    clearedTxs.pop();
-                }
-
-                if (inBlock.count(iter))
-                    continue; // could have been added to the priorityBlock
+            }
+        }
+    }
+}
 
-                const CTransaction& tx = iter->GetTx();
+CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn)
+{
+    return BlockAssembler(chainparams).CreateNewBlock(scriptPubKeyIn);
+}
 
-                bool fOrphan = false;
-                BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
-                {
-                    if (!inBlock.count(parent)) {
-                        fOrphan = true;
-                        break;
-                    }
-                }
-                if (fOrphan) {
-                    if (priorityTx)
-                        waitPriMap.insert(std::make_pair(iter,actualPriority));
-                    else
-                        waitSet.insert(iter);
-                    continue;
-                }
+/**
+ * The block template handed out by getblocktemplate, along with the tip and
+ * mempool state it was built from, and the last template announced to long
+ * polling calls.
+ */
+class CBlockTemplateCache : public CValidationInterface
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    boost::shared_ptr<const CBlockTemplate> pblocktemplate;
+    //! tip and mempool counter the template was built at
+    const CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdated;
+    int64_t nTimeBuilt;
+    //! latest tip we have been told about
+    const CBlockIndex* pindexTip;
+    int64_t nTimeRequested;
+    bool fNotified;
+    bool fRunning;
+    //! announced templates, see GetBlockTemplateGeneration
+    uint64_t nGeneration;
+    const CBlockIndex* pindexAnnounced;
+    CAmount nFeesAnnounced;
+    CAmount nFeeDelta;
+
+    /** Keep a new template; returns whether long polls should hear about it */
+    bool SetTemplate(const boost::shared_ptr<const CBlockTemplate>& pblocktemplateNew, const CBlockIndex* pindexPrevNew,
+                     unsigned int nTransactionsUpdatedNew, int64_t nTimeStart)
+    {
+        pblocktemplate = pblocktemplateNew;
+        pindexPrev = pindexPrevNew;
+        nTransactionsUpdated = nTransactionsUpdatedNew;
+        nTimeBuilt = nTimeStart;
+        if (!pblocktemplate)
+            return false;
+
+        const CAmount nFees = -pblocktemplate->vTxFees[0];
+        if (pindexPrev != pindexAnnounced || nFees >= nFeesAnnounced + nFeeDelta) {
+            nGeneration++;
+            pindexAnnounced = pindexPrev;
+            nFeesAnnounced = nFees;
+            return true;
+        }
+        // Measure the next rise from here if transactions left the mempool
+        nFeesAnnounced = std::min(nFeesAnnounced, nFees);
+        return false;
+    }
 
-                unsigned int nTxSize = iter->GetTxSize();
-                if (fPriorityBlock &&
-                    (nBlockSize + nTxSize >= nBlockPrioritySize || !AllowFree(actualPriority))) {
-                    fPriorityBlock = false;
-                    waitPriMap.clear();
-                }
-                if (!priorityTx &&
-                    (iter->GetModifiedFee() < ::minRelayTxFee.GetFee(nTxSize) && nBlockSize >= nBlockMinSize)) {
-                    break;
-                }
-                if (nBlockSize + nTxSize >= nBlockMaxSize) {
-                    if (nBlockSize >  nBlockMaxSize - 100 || lastFewTxs > 50) {
-                        break;
-                    }
-                    // Once we're within 1000 bytes of a full block, only look at 50 more txs
-                    // to try to fill the remaining space.
-                    if (nBlockSize > nBlockMaxSize - 1000) {
-                        lastFewTxs++;
-                    }
-                    continue;
-                }
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindexNew, const CBlockIndex* pindexFork, bool fInitialDownload) override
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        pindexTip = pindexNew;
+        fNotified = true;
+        cond.notify_all();
+    }
 
-                if (!IsFinalTx(tx, nHeight, nLockTimeCutoff))
-                    continue;
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock) override
+    {
+        // Transactions of connected blocks come along with the tip change
+        if (pblock != NULL)
+            return;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fNotified = true;
+        cond.notify_all();
+    }
 
-                unsigned int nTxSigOps = iter->GetSigOpCount();
-                unsigned int nMaxBlockSigOps = MaxBlockSigOps(fDIP0001ActiveAtTip);
-                if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps) {
-                    if (nBlockSigOps > nMaxBlockSigOps - 2) {
-                        break;
-                    }
-                    continue;
-                }
+public:
+    CBlockTemplateCache() : pindexPrev(NULL), nTransactionsUpdated(0), nTimeBuilt(0), pindexTip(NULL),
+                            nTimeRequested(0), fNotified(false), fRunning(false), nGeneration(0),
+                            pindexAnnounced(NULL), nFeesAnnounced(0), nFeeDelta(DEFAULT_LONGPOLL_FEE_DELTA) {}
 
-                CAmount nTxFees = iter->GetFee();
-                // Added
-                pblock->vtx.push_back(tx);
-                pblocktemplate->vTxFees.push_back(nTxFees);
-                pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-                nBlockSize += nTxSize;
-                ++nBlockTx;
-                nBlockSigOps += nTxSigOps;
-                nFees += nTxFees;
-
-                if (fPrintPriority)
-                {
-                    double dPriority = iter->GetPriority(nHeight);
-                    CAmount dummy;
-                    mempool.ApplyDeltas(tx.GetHash(), dPriority, dummy);
-                    LogPrintf("priority %.1f fee %s txid %s\n",
-                              dPriority , CFeeRate(iter->GetModifiedFee(), nTxSize).ToString(), tx.GetHash().ToString());
-                }
+    void SetRunning(bool fRunningIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = fRunningIn;
+    }
 
-                inBlock.insert(iter);
+    void SetFeeDelta(CAmount nFeeDeltaIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nFeeDelta = nFeeDeltaIn;
+    }
 
-                // Add transactions that depend on this one to the priority queue
-                BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
-                {
-                    if (fPriorityBlock) {
-                        waitPriIter wpiter = waitPriMap.find(child);
-                        if (wpiter != waitPriMap.end()) {
-                            vecPriority.push_back(TxCoinAgePriority(wpiter->second,child));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
-                            waitPriMap.erase(wpiter);
-                        }
-                    }
-                    else {
-                        if (waitSet.count(child)) {
-                            clearedTxs.push(child);
-                            waitSet.erase(child);
-                        }
-                    }
-                }
-            }
+    uint64_t GetGeneration()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nGeneration;
+    }
 
+    /** Build a template on the current tip and keep it; throws what CreateNewBlock throws */
+    boost::shared_ptr<const CBlockTemplate> Build(const CChainParams& chainparams, unsigned int& nTransactionsUpdatedOut)
+    {
+        LOCK(cs_main);
+        const CBlockIndex* pindexPrevNew = chainActive.Tip();
+        const unsigned int nTransactionsUpdatedNew = mempool.GetTransactionsUpdated();
+        const int64_t nTimeStart = GetTimeMillis();
+        boost::shared_ptr<const CBlockTemplate> pblocktemplateNew;
+        try {
+            CScript scriptDummy = CScript() << OP_TRUE;
+            pblocktemplateNew.reset(CreateNewBlock(chainparams, scriptDummy));
+        } catch (const std::exception&) {
+            // Don't try again before the next refresh, unless asked for directly
+            boost::unique_lock<boost::mutex> lock(mutex);
+            SetTemplate(boost::shared_ptr<const CBlockTemplate>(), pindexPrevNew, nTransactionsUpdatedNew, nTimeStart);
+            throw;
         }
 
-        // NOTE: unlike in bitcoin, we need to pass PREVIOUS block height here
-        CAmount blockReward = nFees + GetBlockSubsidy(pindexPrev->nBits, pindexPrev->nHeight, Params().GetConsensus());
+        bool fAnnounce;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fAnnounce = SetTemplate(pblocktemplateNew, pindexPrevNew, nTransactionsUpdatedNew, nTimeStart);
+        }
+        if (fAnnounce)
+            WakeDeferredRPCs();
+        nTransactionsUpdatedOut = nTransactionsUpdatedNew;
+        return pblocktemplateNew;
+    }
 
-        // Compute regular coinbase transaction.
-        txNew.vout[0].nValue = blockReward;
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    boost::shared_ptr<const CBlockTemplate> Get(const CChainParams& chainparams, unsigned int& nTransactionsUpdatedOut)
+    {
+        AssertLockHeld(cs_main);
+        const CBlockIndex* pindexActive = chainActive.Tip();
+        const unsigned int nTransactionsUpdatedNow = mempool.GetTransactionsUpdated();
+        const int64_t nNow = GetTimeMillis();
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // Wake the builder up if it went idle
+            if (nNow - nTimeRequested > BLOCK_TEMPLATE_IDLE_TIMEOUT * 1000)
+                cond.notify_all();
+            nTimeRequested = nNow;
+            pindexTip = pindexActive;
+
+            // Without the builder thread, rebuild here once the mempool changed
+            // and the template is old enough
+            bool fStale = !fRunning && nTransactionsUpdatedNow != nTransactionsUpdated &&
+                          nNow - nTimeBuilt >= GetArg("-blocktemplaterefresh", DEFAULT_BLOCK_TEMPLATE_REFRESH);
+            if (pblocktemplate && pindexPrev == pindexActive && !fStale) {
+                nTransactionsUpdatedOut = nTransactionsUpdated;
+                return pblocktemplate;
+            }
+        }
+        return Build(chainparams, nTransactionsUpdatedOut);
+    }
 
-        // Founder Reward
-        CAmount founderReward = GetFounderPayment(nHeight);
-        if (founderReward > 0) {
-            CScript FOUNDER_SCRIPT = GetScriptForDestination(CBitcoinAddress(Params().FounderAddress()).Get());
-            txNew.vout[0].nValue -= founderReward;
-            txNew.vout.push_back(CTxOut(founderReward, CScript(FOUNDER_SCRIPT.begin(), FOUNDER_SCRIPT.end())));
+    /** Wait until a template that is being asked for needs to be rebuilt */
+    void WaitForWork(int64_t nRefresh)
+    {
+        while (true) {
+            boost::this_thread::interruption_point();
+            // Read outside of our lock, notifications may come in with mempool.cs held
+            const unsigned int nTransactionsUpdatedNow = mempool.GetTransactionsUpdated();
+            const int64_t nNow = GetTimeMillis();
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            const bool fNotifiedBefore = fNotified;
+            fNotified = false;
+            if (nNow - nTimeRequested > BLOCK_TEMPLATE_IDLE_TIMEOUT * 1000) {
+                // Nobody is mining on us, sleep until the next request
+                cond.wait(lock);
+                continue;
+            }
+            if (pindexTip != NULL && pindexTip != pindexPrev)
+                return;
+            if (nTransactionsUpdatedNow != nTransactionsUpdated) {
+                if (nNow - nTimeBuilt >= nRefresh)
+                    return;
+                cond.timed_wait(lock, boost::posix_time::milliseconds(nRefresh - (nNow - nTimeBuilt)));
+                continue;
+            }
+            // Removals from the mempool are not notified, so look again
+            // after a while even if nothing came in
+            if (!fNotifiedBefore)
+                cond.timed_wait(lock, boost::posix_time::milliseconds(nRefresh));
         }
+    }
+};
+
+static CBlockTemplateCache blockTemplateCache;
+
+static void ThreadBlockTemplateBuilder(const CChainParams& chainparams)
+{
+    RenameThread("npscoin-gbt");
 
-        // Update coinbase transaction with additional info about masternode and governance payments,
-        // get some info back to pass to getblocktemplate
-        FillBlockPayments(txNew, nHeight, blockReward, pblock->txoutMasternode, pblock->voutSuperblock);
-        // LogPrintf("CreateNewBlock -- nBlockHeight %d blockReward %lld txoutMasternode %s txNew %s",
-        //             nHeight, blockReward, pblock->txoutMasternode.ToString(), txNew.ToString());
-
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u txs: %u fees: %ld sigops %d\n", nBlockSize, nBlockTx, nFees, nBlockSigOps);
-
-        // Update block coinbase
-        pblock->vtx[0] = txNew;
-        pblocktemplate->vTxFees[0] = -nFees;
-
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
-        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
-        pblock->nNonce         = 0;
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
-
-        CValidationState state;
-        if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
-            throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+    const int64_t nRefresh = std::max((int64_t)1, GetArg("-blocktemplaterefresh", DEFAULT_BLOCK_TEMPLATE_REFRESH));
+    try {
+        while (true) {
+            blockTemplateCache.WaitForWork(nRefresh);
+            try {
+                unsigned int nTransactionsUpdated;
+                blockTemplateCache.Build(chainparams, nTransactionsUpdated);
+            } catch (const std::exception& e) {
+                LogPrintf("%s: %s\n", __func__, e.what());
+            }
         }
+    } catch (const boost::thread_interrupted&) {
+        blockTemplateCache.SetRunning(false);
+        throw;
     }
+}
 
-    return pblocktemplate.release();
+void StartBlockTemplateBuilder(boost::thread_group& threadGroup, const CChainParams& chainparams, CAmount nLongPollFeeDelta)
+{
+    blockTemplateCache.SetFeeDelta(nLongPollFeeDelta);
+    blockTemplateCache.SetRunning(true);
+    RegisterValidationInterface(&blockTemplateCache);
+    threadGroup.create_thread(boost::bind(&ThreadBlockTemplateBuilder, boost::cref(chainparams)));
+}
+
+void StopBlockTemplateBuilder()
+{
+    blockTemplateCache.SetRunning(false);
+    UnregisterValidationInterface(&blockTemplateCache);
+}
+
+boost::shared_ptr<const CBlockTemplate> GetBlockTemplate(const CChainParams& chainparams, unsigned int& nTransactionsUpdated)
+{
+    return blockTemplateCache.Get(chainparams, nTransactionsUpdated);
+}
+
+uint64_t GetBlockTemplateGeneration()
+{
+    return blockTemplateCache.GetGeneration();
 }
 
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
@@ -342,11 +797,11 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    CMutableTransaction txCoinbase(*pblock->vtx[0]);
     txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(txCoinbase.vin[0].scriptSig.size() <= 100);
 
-    pblock->vtx[0] = txCoinbase;
+    pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
 
@@ -354,7 +809,7 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
 static bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainparams)
 {
     LogPrintf("%s\n", pblock->ToString());
-    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0].vout[0].nValue));
+    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0]->vout[0].nValue));
 
     // Found a solution
     {
@@ -433,10 +888,15 @@ void static BitcoinMiner(const CChainParams& chainparams, CConnman& connman)
             {
                 unsigned int nHashesDone = 0;
 
+                // Only nTime, nBits and nNonce change below, so the first
+                // Blake256 block of the header is the same for every nonce
+                lyra2z_midstate midstate;
+                lyra2z_midstate_init(&midstate, BEGIN(pblock->nVersion));
+
                 uint256 thash;
                 while (true)
                 {
-                    lyra2z_hash(BEGIN(pblock->nVersion), BEGIN(thash));
+                    lyra2z_hash_midstate(&midstate, BEGIN(pblock->nVersion), BEGIN(thash));
                     if (UintToArith256(thash) <= hashTarget)
                     {
                         // Found a solution
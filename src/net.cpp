@@ -20,8 +20,10 @@
 #include "primitives/transaction.h"
 #include "netbase.h"
 #include "scheduler.h"
+#include "txmempool.h"
 #include "ui_interface.h"
 #include "utilstrencodings.h"
+#include "validation.h"
 
 #include "instantx.h"
 #include "masternode-sync.h"
@@ -34,6 +36,13 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_POLL
+#include <poll.h>
+#endif
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -50,6 +59,12 @@
 // We add a random period time (0 to 1 seconds) to feeler connections to prevent synchronization.
 #define FEELER_SLEEP_WINDOW 1
 
+// How long the socket handler waits for socket events before looking at the nodes again (ms)
+#define SOCKET_EVENTS_TIMEOUT 50
+
+// Maximum number of events taken from the kernel in one epoll_wait() call
+#define EPOLL_MAX_EVENTS 1024
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -82,8 +97,8 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 std::string strSubVersion;
 
-std::map<CInv, CDataStream> mapRelay;
-std::deque<pair<int64_t, CInv> > vRelayExpiration;
+std::map<uint256, CTransactionRef> mapRelay;
+std::deque<pair<int64_t, uint256> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<uint256, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
@@ -97,6 +112,49 @@ void CConnman::AddOneShot(const std::string& strDest)
     vOneShots.push_back(strDest);
 }
 
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& modeRet)
+{
+    if (strMode == "select") {
+        modeRet = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef USE_POLL
+    if (strMode == "poll") {
+        modeRet = SOCKETEVENTS_POLL;
+        return true;
+    }
+#endif
+#ifdef USE_EPOLL
+    if (strMode == "epoll") {
+        modeRet = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+std::string GetSocketEventsModeName(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SOCKETEVENTS_SELECT: return "select";
+    case SOCKETEVENTS_POLL: return "poll";
+    case SOCKETEVENTS_EPOLL: return "epoll";
+    }
+    return "unknown";
+}
+
+std::string GetSupportedSocketEventsModes()
+{
+    std::string strModes = "select";
+#ifdef USE_POLL
+    strModes += ", poll";
+#endif
+#ifdef USE_EPOLL
+    strModes += ", epoll";
+#endif
+    return strModes;
+}
+
 unsigned short GetListenPort()
 {
     return (unsigned short)(GetArg("-port", Params().GetDefaultPort()));
@@ -384,7 +442,7 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsWatchableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -428,6 +486,7 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
         GetNodeSignals().InitializeNode(pnode, *this);
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+        RegisterEvents(pnode);
 
         return pnode;
     } else if (!proxyConnectionFailed) {
@@ -685,7 +744,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION));
+            vRecvMsg.emplace_back(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -725,6 +784,20 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
     return true;
 }
 
+bool CNode::GetRecvDataBuffer(char*& pchRet, unsigned int& nSizeRet, unsigned int nMinSize)
+{
+    if (vRecvMsg.empty())
+        return false;
+    CNetMessage& msg = vRecvMsg.back();
+    if (!msg.in_data || msg.hdr.nMessageSize - msg.nDataPos < nMinSize)
+        return false;
+
+    msg.PrepareData(std::min(msg.hdr.nMessageSize - msg.nDataPos, CNetMessage::PREALLOC_MAX_SIZE));
+    pchRet = &msg.vRecv[msg.nDataPos];
+    nSizeRet = msg.vRecv.size() - msg.nDataPos;
+    return true;
+}
+
 void CNode::SetSendVersion(int nVersionIn)
 {
     // Send version may only be changed in the version message, and
@@ -780,25 +853,121 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // The payload buffer is sized by what the header announces, up to
+    // PREALLOC_MAX_SIZE, a peer can't make us reserve more than that for
+    // data it hasn't sent
+    CSerializeData vch;
+    GetNetMessageBufferPool().Get(vch, std::min(hdr.nMessageSize, PREALLOC_MAX_SIZE));
+    vRecv.swap(vch);
+
     return nCopy;
 }
 
+void CNetMessage::PrepareData(unsigned int nBytes)
+{
+    if (vRecv.size() >= nDataPos + nBytes)
+        return;
+
+    // Allocate up to 256 KiB ahead, but never more than the total message size.
+    size_t nNewSize = std::min(hdr.nMessageSize, nDataPos + nBytes + PREALLOC_MAX_SIZE);
+    CSerializeData vch;
+    vRecv.swap(vch);
+    if (nNewSize > vch.capacity()) {
+        // Move to a pooled buffer of at least twice the size, the old one goes back
+        CSerializeData vchNew;
+        GetNetMessageBufferPool().Get(vchNew, std::min<size_t>(hdr.nMessageSize, std::max(nNewSize, 2 * vch.capacity())));
+        vchNew.insert(vchNew.end(), vch.begin(), vch.begin() + nDataPos);
+        GetNetMessageBufferPool().Put(vch);
+        vch.swap(vchNew);
+    }
+    vch.resize(nNewSize);
+    vRecv.swap(vch);
+}
+
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
+    PrepareData(nCopy);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // Nothing to copy if the socket was read right into place (GetRecvDataBuffer)
+    if (nCopy > 0 && pch != &vRecv[nDataPos])
+        memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+CNetMessage::~CNetMessage()
+{
+    CSerializeData vch;
+    vRecv.swap(vch);
+    GetNetMessageBufferPool().Put(vch);
+}
+
+CNetMessageBufferPool& GetNetMessageBufferPool()
+{
+    // Never destroyed, messages may outlive other statics at shutdown
+    static CNetMessageBufferPool* pool = new CNetMessageBufferPool();
+    return *pool;
+}
+
+void CNetMessageBufferPool::Get(CSerializeData& vchRet, size_t nSize)
+{
+    int nClass = 0;
+    while (nClass < SIZE_CLASSES - 1 && ((size_t)1 << (MIN_SIZE_BITS + nClass)) < nSize)
+        nClass++;
+
+    {
+        LOCK(cs);
+        // Any buffer of the class is large enough, the classes are what Put() rounds down to
+        if (!vFree[nClass].empty() && vFree[nClass].back().capacity() >= nSize) {
+            vchRet.swap(vFree[nClass].back());
+            vFree[nClass].pop_back();
+            nPooledBytes -= vchRet.capacity();
+            vchRet.clear();
+            return;
+        }
+    }
+
+    CSerializeData vch;
+    vch.reserve(std::max(nSize, (size_t)1 << (MIN_SIZE_BITS + nClass)));
+    vchRet.swap(vch);
+}
+
+void CNetMessageBufferPool::Put(CSerializeData& vch)
+{
+    size_t nCapacity = vch.capacity();
+    if (nCapacity < ((size_t)1 << MIN_SIZE_BITS)) {
+        CSerializeData().swap(vch);
+        return;
+    }
+
+    int nClass = 0;
+    while (nClass < SIZE_CLASSES - 1 && ((size_t)1 << (MIN_SIZE_BITS + nClass + 1)) <= nCapacity)
+        nClass++;
+
+    vch.clear();
+    {
+        LOCK(cs);
+        if (nPooledBytes + nCapacity <= nMaxPooledBytes) {
+            nPooledBytes += nCapacity;
+            vFree[nClass].push_back(CSerializeData());
+            vFree[nClass].back().swap(vch);
+            return;
+        }
+    }
+    // The pool is full
+    CSerializeData().swap(vch);
+}
+
+size_t CNetMessageBufferPool::GetPooledBytes() const
+{
+    LOCK(cs);
+    return nPooledBytes;
+}
+
 
 
 
@@ -1054,7 +1223,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsWatchableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1103,6 +1272,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+        RegisterEvents(pnode);
     }
 }
 
@@ -1127,6 +1297,8 @@ void CConnman::ThreadSocketHandler()
 
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    setReceivableNodes.erase(pnode);
+                    setSendableNodes.erase(pnode);
 
                     // release outbound grant (if any)
                     pnode->grantOutbound.Release();
@@ -1182,207 +1354,423 @@ void CConnman::ThreadSocketHandler()
         }
 
         //
-        // Find which sockets have data to receive
+        // Wait for socket events
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is space left in the receive buffer, select() for
-                //   receiving data.
-                // * Hand off all complete messages to the processor, to be handled without
-                //   blocking here.
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend) {
-                        if (!pnode->vSendMsg.empty()) {
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                            continue;
-                        }
-                    }
-                }
-                {
-                    if (!pnode->fPauseRecv)
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        std::set<SOCKET> setListenReady;
+        SocketEvents(setListenReady);
         if (interruptNet)
             return;
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
-                return;
-        }
-
         //
         // Accept new connections
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && setListenReady.count(hListenSocket.socket))
             {
                 AcceptConnection(hListenSocket);
             }
         }
 
         //
-        // Service each socket
+        // Service the sockets that are ready
         //
-        std::vector<CNode*> vNodesCopy = CopyNodeVector();
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        std::vector<CNode*> vReceivable(setReceivableNodes.begin(), setReceivableNodes.end());
+        BOOST_FOREACH(CNode* pnode, vReceivable)
         {
             if (interruptNet)
                 return;
+            // stays receivable, picked up again once the message handler caught up
+            if (pnode->fPauseRecv)
+                continue;
+            SocketRecvData(pnode);
+        }
 
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
+        std::vector<CNode*> vSendable(setSendableNodes.begin(), setSendableNodes.end());
+        BOOST_FOREACH(CNode* pnode, vSendable)
+        {
+            if (interruptNet)
+                return;
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (!lockSend)
+                continue; // try again on the next round
+            setSendableNodes.erase(pnode);
+            if (pnode->hSocket == INVALID_SOCKET || pnode->vSendMsg.empty())
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            // Either this drains the queue, or it stops because the socket buffer
+            // is full and there will be another event once it has room again
+            size_t nBytes = SocketSendData(pnode);
+            if (nBytes) {
+                RecordBytesSent(nBytes);
+            }
+        }
+
+        //
+        // Inactivity checking, the timeouts are in seconds so once per second will do
+        //
+        int64_t nTime = GetSystemTimeInSeconds();
+        if (nTime != nLastInactivityCheck)
+        {
+            nLastInactivityCheck = nTime;
+            std::vector<CNode*> vNodesCopy = CopyNodeVector();
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            bool notify = false;
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
-                                pnode->CloseSocketDisconnect();
-                            RecordBytesRecv(nBytes);
-                            if (notify) {
-                                size_t nSizeAdded = 0;
-                                auto it(pnode->vRecvMsg.begin());
-                                for (; it != pnode->vRecvMsg.end(); ++it) {
-                                    if (!it->complete())
-                                        break;
-                                    nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
-                                }
-                                {
-                                    LOCK(pnode->cs_vProcessMsg);
-                                    pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
-                                    pnode->nProcessQueueSize += nSizeAdded;
-                                    pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
-                                }
-                                WakeMessageHandler();
-                            }
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
+                InactivityCheck(pnode);
+#ifdef USE_EPOLL
+                // An edge-triggered epoll only reports a socket as writable again after
+                // a send filled its buffer. Catch queues left behind by a send that gave
+                // up for another reason (EINTR).
+                if (socketEventsMode == SOCKETEVENTS_EPOLL && !setSendableNodes.count(pnode)) {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend && !pnode->vSendMsg.empty())
+                        setSendableNodes.insert(pnode);
                 }
+#endif
+            }
+            ReleaseNodeVector(vNodesCopy);
+        }
+    }
+}
+
+void CConnman::SocketRecvData(CNode* pnode)
+{
+    if (pnode->hSocket == INVALID_SOCKET) {
+        setReceivableNodes.erase(pnode);
+        return;
+    }
+
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    char* pchRecv = pchBuf;
+    unsigned int nRecvSize = sizeof(pchBuf);
+    // Read the rest of a large payload straight into the message buffer
+    pnode->GetRecvDataBuffer(pchRecv, nRecvSize, sizeof(pchBuf));
+    int nBytes = recv(pnode->hSocket, pchRecv, nRecvSize, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        bool notify = false;
+        if (!pnode->ReceiveMsgBytes(pchRecv, nBytes, notify))
+            pnode->CloseSocketDisconnect();
+        RecordBytesRecv(nBytes);
+        if (notify) {
+            size_t nSizeAdded = 0;
+            auto it(pnode->vRecvMsg.begin());
+            for (; it != pnode->vRecvMsg.end(); ++it) {
+                if (!it->complete())
+                    break;
+                nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
+            }
+            {
+                LOCK(pnode->cs_vProcessMsg);
+                pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
+                pnode->nProcessQueueSize += nSizeAdded;
+                pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
             }
+            WakeMessageHandler();
+        }
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
 
-            //
-            // Send
-            //
+    // Only a full buffer means there may be more to read right away; anything
+    // that arrives after a short read comes with a new event
+    if (nBytes != (int)nRecvSize)
+        setReceivableNodes.erase(pnode);
+}
+
+void CConnman::InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetSystemTimeInSeconds();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+bool CConnman::IsWatchableSocket(SOCKET hSocket) const
+{
+    // Only select() is limited to descriptors below FD_SETSIZE
+    return socketEventsMode != SOCKETEVENTS_SELECT || IsSelectableSocket(hSocket);
+}
+
+void CConnman::RegisterEvents(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (socketEventsMode != SOCKETEVENTS_EPOLL)
+        return;
+
+    // The registration goes away by itself once the socket is closed
+    struct epoll_event event = {};
+    event.data.ptr = pnode;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("%s -- epoll_ctl failed for peer=%d: %s\n", __func__, pnode->id, NetworkErrorString(WSAGetLastError()));
+        pnode->fDisconnect = true;
+    }
+#endif
+}
+
+void CConnman::SocketEvents(std::set<SOCKET>& setListenReady)
+{
+    switch (socketEventsMode) {
+#ifdef USE_EPOLL
+    case SOCKETEVENTS_EPOLL:
+        SocketEventsEpoll(setListenReady);
+        break;
+#endif
+#ifdef USE_POLL
+    case SOCKETEVENTS_POLL:
+        SocketEventsPoll(setListenReady);
+        break;
+#endif
+    default:
+        SocketEventsSelect(setListenReady);
+        break;
+    }
+}
+
+void CConnman::SocketEventsSelect(std::set<SOCKET>& setListenReady)
+{
+    setReceivableNodes.clear();
+    setSendableNodes.clear();
+
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SOCKET_EVENTS_TIMEOUT * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+    std::vector<std::pair<CNode*, SOCKET> > vWatched;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = std::max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+            vWatched.push_back(std::make_pair(pnode, pnode->hSocket));
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is space left in the receive buffer, select() for
+            //   receiving data.
+            // * Hand off all complete messages to the processor, to be handled without
+            //   blocking here.
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend) {
-                    size_t nBytes = SocketSendData(pnode);
-                    if (nBytes) {
-                        RecordBytesSent(nBytes);
+                    if (!pnode->vSendMsg.empty()) {
+                        FD_SET(pnode->hSocket, &fdsetSend);
+                        continue;
                     }
                 }
             }
+            {
+                if (!pnode->fPauseRecv)
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (interruptNet)
+        return;
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
+            return;
+    }
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        if (FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            setListenReady.insert(hListenSocket.socket);
+    }
+    for (size_t i = 0; i < vWatched.size(); i++) {
+        SOCKET hSocket = vWatched[i].second;
+        if (FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError))
+            setReceivableNodes.insert(vWatched[i].first);
+        if (FD_ISSET(hSocket, &fdsetSend))
+            setSendableNodes.insert(vWatched[i].first);
+    }
+}
+
+#ifdef USE_POLL
+void CConnman::SocketEventsPoll(std::set<SOCKET>& setListenReady)
+{
+    setReceivableNodes.clear();
+    setSendableNodes.clear();
+
+    // Listen sockets first, then one entry per node in vPollNodes
+    std::vector<struct pollfd> vPollFds;
+    std::vector<CNode*> vPollNodes;
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetSystemTimeInSeconds();
-            if (nTime - pnode->nTimeConnected > 60)
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        struct pollfd pollfd = {};
+        pollfd.fd = hListenSocket.socket;
+        pollfd.events = POLLIN;
+        vPollFds.push_back(pollfd);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            struct pollfd pollfd = {};
+            pollfd.fd = pnode->hSocket;
+            // Same logic as with select(): drain the send queue before reading more,
+            // errors and hangups are always reported
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty())
+                    pollfd.events = POLLOUT;
             }
+            if (pollfd.events == 0 && !pnode->fPauseRecv)
+                pollfd.events = POLLIN;
+            vPollFds.push_back(pollfd);
+            vPollNodes.push_back(pnode);
+        }
+    }
+
+    int nRet = poll(vPollFds.data(), vPollFds.size(), SOCKET_EVENTS_TIMEOUT);
+    if (interruptNet)
+        return;
+
+    if (nRet == SOCKET_ERROR)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR) {
+            LogPrintf("socket poll error %s\n", NetworkErrorString(nErr));
+            interruptNet.sleep_for(std::chrono::milliseconds(SOCKET_EVENTS_TIMEOUT));
+        }
+        return;
+    }
+
+    size_t nListen = vhListenSocket.size();
+    for (size_t i = 0; i < nListen; i++) {
+        if (vPollFds[i].revents & POLLIN)
+            setListenReady.insert(vPollFds[i].fd);
+    }
+    for (size_t i = 0; i < vPollNodes.size(); i++) {
+        short revents = vPollFds[nListen + i].revents;
+        if (revents & (POLLIN | POLLERR | POLLHUP))
+            setReceivableNodes.insert(vPollNodes[i]);
+        if (revents & POLLOUT)
+            setSendableNodes.insert(vPollNodes[i]);
+    }
+}
+#endif
+
+#ifdef USE_EPOLL
+void CConnman::SocketEventsEpoll(std::set<SOCKET>& setListenReady)
+{
+    // Don't wait if a node still has data from an earlier event to handle.
+    // Nodes whose receiving is paused are looked at again after the timeout.
+    int nTimeout = setSendableNodes.empty() ? SOCKET_EVENTS_TIMEOUT : 0;
+    BOOST_FOREACH(CNode* pnode, setReceivableNodes) {
+        if (!pnode->fPauseRecv) {
+            nTimeout = 0;
+            break;
         }
-        ReleaseNodeVector(vNodesCopy);
+    }
+
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int nEvents = epoll_wait(epollfd, events, EPOLL_MAX_EVENTS, nTimeout);
+    if (interruptNet)
+        return;
+
+    if (nEvents < 0)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+            interruptNet.sleep_for(std::chrono::milliseconds(SOCKET_EVENTS_TIMEOUT));
+        }
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        CNode* pnode = static_cast<CNode*>(events[i].data.ptr);
+        if (pnode == NULL) {
+            // Listen sockets are registered without a node. There are only a
+            // few of them and they are non-blocking, so just try them all.
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+                setListenReady.insert(hListenSocket.socket);
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            setReceivableNodes.insert(pnode);
+        if (events[i].events & EPOLLOUT)
+            setSendableNodes.insert(pnode);
     }
 }
+#endif
 
 void CConnman::WakeMessageHandler()
 {
@@ -1925,23 +2313,28 @@ void CConnman::ThreadMessageHandler()
 
         bool fMoreWork = false;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Threads start their passes at different nodes, otherwise they would
+        // all queue up behind the first one
+        size_t nOffset = nMessageHandlerOffset++;
+        for (size_t i = 0; i < vNodesCopy.size(); i++)
         {
+            CNode* pnode = vNodesCopy[(nOffset + i) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
+            // Another thread is on this node, it will see to the node's work
+            if (pnode->fProcessingMessages.exchange(true))
+                continue;
+
             // Receive messages
             bool fMoreNodeWork = GetNodeSignals().ProcessMessages(pnode, *this, flagInterruptMsgProc);
             fMoreWork |= (fMoreNodeWork && !pnode->fPauseSend);
-            if (flagInterruptMsgProc)
-                return;
 
             // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    GetNodeSignals().SendMessages(pnode, *this, flagInterruptMsgProc);
-            }
+            if (!flagInterruptMsgProc)
+                GetNodeSignals().SendMessages(pnode, *this, flagInterruptMsgProc);
+
+            pnode->fProcessingMessages = false;
             if (flagInterruptMsgProc)
                 return;
         }
@@ -2146,6 +2539,13 @@ CConnman::CConnman()
     nBestHeight = 0;
     clientInterface = NULL;
     flagInterruptMsgProc = false;
+    nMessageHandlerThreads = 1;
+    nMessageHandlerOffset = 0;
+    socketEventsMode = DEFAULT_SOCKETEVENTS;
+#ifdef USE_EPOLL
+    epollfd = -1;
+#endif
+    nLastInactivityCheck = 0;
 }
 
 NodeId CConnman::GetNewNodeId()
@@ -2171,6 +2571,30 @@ bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options c
     nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
     nReceiveFloodSize = connOptions.nReceiveFloodSize;
 
+    socketEventsMode = connOptions.socketEventsMode;
+    nMessageHandlerThreads = std::max(1, std::min(connOptions.nMessageHandlerThreads, MAX_MSGHANDLER_THREADS));
+#ifdef USE_EPOLL
+    if (socketEventsMode == SOCKETEVENTS_EPOLL) {
+        epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollfd == -1) {
+            strNodeError = strprintf("Failed to create epoll instance: %s", NetworkErrorString(WSAGetLastError()));
+            LogPrintf("%s\n", strNodeError);
+            return false;
+        }
+        // Listen sockets stay level-triggered, one connection is accepted per round
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+            struct epoll_event event = {};
+            event.data.ptr = NULL;
+            event.events = EPOLLIN;
+            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0) {
+                strNodeError = strprintf("Failed to watch listen socket with epoll: %s", NetworkErrorString(WSAGetLastError()));
+                LogPrintf("%s\n", strNodeError);
+                return false;
+            }
+        }
+    }
+#endif
+
     SetBestHeight(connOptions.nBestHeight);
 
     clientInterface = connOptions.uiInterface;
@@ -2256,7 +2680,9 @@ bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options c
     threadMnbRequestConnections = std::thread(&TraceThread<std::function<void()> >, "mnbcon", std::function<void()>(std::bind(&CConnman::ThreadMnbRequestConnections, this)));
 
     // Process messages
-    threadMessageHandler = std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+    LogPrintf("Using %d threads for peer message processing\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadMessageHandlers.push_back(std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this))));
 
     // Dump network addresses
     scheduler.scheduleEvery(boost::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL);
@@ -2305,8 +2731,11 @@ void CConnman::Interrupt()
 
 void CConnman::Stop()
 {
-    if (threadMessageHandler.joinable())
-        threadMessageHandler.join();
+    BOOST_FOREACH(std::thread& threadMessageHandler, threadMessageHandlers) {
+        if (threadMessageHandler.joinable())
+            threadMessageHandler.join();
+    }
+    threadMessageHandlers.clear();
     if (threadMnbRequestConnections.joinable())
         threadMnbRequestConnections.join();
     if (threadOpenConnections.joinable())
@@ -2347,6 +2776,14 @@ void CConnman::Stop()
     vNodes.clear();
     vNodesDisconnected.clear();
     vhListenSocket.clear();
+    setReceivableNodes.clear();
+    setSendableNodes.clear();
+#ifdef USE_EPOLL
+    if (epollfd != -1) {
+        close(epollfd);
+        epollfd = -1;
+    }
+#endif
     delete semOutbound;
     semOutbound = NULL;
     delete semMasternodeOutbound;
@@ -2476,23 +2913,14 @@ bool CConnman::DisconnectNode(NodeId id)
 
 void CConnman::RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    uint256 hash = tx.GetHash();
-    CTxLockRequest txLockRequest;
-    CDarksendBroadcastTx dstx = CPrivateSend::GetDSTX(hash);
-    if(dstx) { // MSG_DSTX
-        ss << dstx;
-    } else if(instantsend.GetTxLockRequest(hash, txLockRequest)) { // MSG_TXLOCK_REQUEST
-        ss << txLockRequest;
-    } else { // MSG_TX
-        ss << tx;
-    }
-    RelayTransaction(tx, ss);
+    // Share the mempool's transaction rather than keeping a copy of our own
+    CTransactionRef ptx = mempool.get(tx.GetHash());
+    RelayTransaction(ptx ? ptx : MakeTransactionRef(tx));
 }
 
-void CConnman::RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void CConnman::RelayTransaction(const CTransactionRef& ptx)
 {
+    const CTransaction& tx = *ptx;
     uint256 hash = tx.GetHash();
     int nInv = static_cast<bool>(CPrivateSend::GetDSTX(hash)) ? MSG_DSTX :
                 (instantsend.HasTxLockRequest(hash) ? MSG_TXLOCK_REQUEST : MSG_TX);
@@ -2506,9 +2934,10 @@ void CConnman::RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        // Keep the transaction for peers asking for it later; DSTX and lock
+        // requests are served from their own maps, which hold the extra data
+        mapRelay.insert(std::make_pair(hash, ptx));
+        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, hash));
     }
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -2716,6 +3145,7 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nLocalServices = nLocalServicesIn;
     fPauseRecv = false;
     fPauseSend = false;
+    fProcessingMessages = false;
     nProcessQueueSize = 0;
 
     GetRandBytes((unsigned char*)&nLocalHostNonce, sizeof(nLocalHostNonce));
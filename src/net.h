@@ -12,6 +12,7 @@
 #include "compat.h"
 #include "limitedmap.h"
 #include "netaddress.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
@@ -25,6 +26,7 @@
 #include <stdint.h>
 #include <thread>
 #include <memory>
+#include <set>
 #include <condition_variable>
 
 #ifndef WIN32
@@ -88,6 +90,33 @@ static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
+/** Default number of threads processing peer messages (-msghandlerthreads) */
+static const int DEFAULT_MSGHANDLER_THREADS = 4;
+/** Maximum number of threads processing peer messages */
+static const int MAX_MSGHANDLER_THREADS = 16;
+
+/** How the socket handler waits for its sockets to become ready (-socketevents) */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT = 0,
+    SOCKETEVENTS_POLL = 1,
+    SOCKETEVENTS_EPOLL = 2,
+};
+
+/** -socketevents default, the most scalable mode this platform has */
+#if defined(USE_EPOLL)
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_EPOLL;
+#elif defined(USE_POLL)
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_POLL;
+#else
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_SELECT;
+#endif
+
+/** Parse a -socketevents value, fails for modes this platform does not support */
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& modeRet);
+std::string GetSocketEventsModeName(SocketEventsMode mode);
+/** The -socketevents values supported on this platform, for the help message */
+std::string GetSupportedSocketEventsModes();
+
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
 
@@ -101,7 +130,6 @@ struct AddedNodeInfo
     bool fInbound;
 };
 
-class CTransaction;
 class CNodeStats;
 class CClientUIInterface;
 
@@ -127,6 +155,8 @@ public:
         CClientUIInterface* uiInterface = nullptr;
         unsigned int nSendBufferMaxSize = 0;
         unsigned int nReceiveFloodSize = 0;
+        SocketEventsMode socketEventsMode = DEFAULT_SOCKETEVENTS;
+        int nMessageHandlerThreads = 1;
     };
     CConnman();
     ~CConnman();
@@ -305,7 +335,7 @@ public:
     void ReleaseNodeVector(const std::vector<CNode*>& vecNodes);
 
     void RelayTransaction(const CTransaction& tx);
-    void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+    void RelayTransaction(const CTransactionRef& ptx);
     void RelayInv(CInv &inv, const int minProtoVersion = MIN_PEER_PROTO_VERSION);
 
     // Addrman functions
@@ -406,6 +436,20 @@ private:
 
     void WakeMessageHandler();
 
+    // Socket readiness, see setReceivableNodes and setSendableNodes
+    bool IsWatchableSocket(SOCKET hSocket) const;
+    void RegisterEvents(CNode* pnode);
+    void SocketEvents(std::set<SOCKET>& setListenReady);
+    void SocketEventsSelect(std::set<SOCKET>& setListenReady);
+#ifdef USE_POLL
+    void SocketEventsPoll(std::set<SOCKET>& setListenReady);
+#endif
+#ifdef USE_EPOLL
+    void SocketEventsEpoll(std::set<SOCKET>& setListenReady);
+#endif
+    void SocketRecvData(CNode* pnode);
+    void InactivityCheck(CNode* pnode);
+
     CNode* FindNode(const CNetAddr& ip);
     CNode* FindNode(const CSubNet& subNet);
     CNode* FindNode(const std::string& addrName);
@@ -461,6 +505,22 @@ private:
     unsigned int nReceiveFloodSize;
 
     std::vector<ListenSocket> vhListenSocket;
+    SocketEventsMode socketEventsMode;
+#ifdef USE_EPOLL
+    /** epoll instance all node and listen sockets stay registered with in SOCKETEVENTS_EPOLL mode */
+    int epollfd;
+#endif
+    /**
+     * Nodes that are ready for reading / writing, as reported by SocketEvents().
+     * select and poll are level-triggered and refill these on every call. With
+     * edge-triggered epoll a node stays in here until a read or write on it
+     * would block, as no new event will come for data that is already there.
+     * Only used by the socket handler thread, which is also the only one
+     * deleting nodes, so the pointers stay valid while they are in here.
+     */
+    std::set<CNode*> setReceivableNodes;
+    std::set<CNode*> setSendableNodes;
+    int64_t nLastInactivityCheck;
     bool fNetworkActive;
     banmap_t setBanned;
     CCriticalSection cs_setBanned;
@@ -492,6 +552,9 @@ private:
 
     /** flag for waking the message processor. */
     bool fMsgProcWake;
+    int nMessageHandlerThreads;
+    /** where the next pass of a message handler thread starts in vNodes */
+    std::atomic<unsigned int> nMessageHandlerOffset;
 
     std::condition_variable condMsgProc;
     std::mutex mutexMsgProc;
@@ -504,7 +567,7 @@ private:
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
     std::thread threadMnbRequestConnections;
-    std::thread threadMessageHandler;
+    std::vector<std::thread> threadMessageHandlers;
 };
 extern std::unique_ptr<CConnman> g_connman;
 void Discover(boost::thread_group& threadGroup);
@@ -571,8 +634,8 @@ extern bool fDiscover;
 extern bool fListen;
 extern bool fRelayTxes;
 
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
+extern std::map<uint256, CTransactionRef> mapRelay;
+extern std::deque<std::pair<int64_t, uint256> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
 
@@ -618,8 +681,43 @@ public:
 
 
 
+/**
+ * Payload buffers of received messages, recycled by power of two size class.
+ * A message takes a buffer as soon as its header is in and gives it back when
+ * it is destroyed, so that peers don't cost an allocation (and a wipe on
+ * free) per message and blocks don't reallocate their way up.
+ */
+class CNetMessageBufferPool
+{
+public:
+    static const int MIN_SIZE_BITS = 10; // 1 KiB
+    static const int MAX_SIZE_BITS = 22; // 4 MiB, more than MAX_PROTOCOL_MESSAGE_LENGTH
+    static const size_t DEFAULT_MAX_POOLED_BYTES = 16 * 1024 * 1024;
+
+    CNetMessageBufferPool(size_t nMaxPooledBytesIn = DEFAULT_MAX_POOLED_BYTES) : nPooledBytes(0), nMaxPooledBytes(nMaxPooledBytesIn) {}
+
+    /** Replace vchRet with an empty buffer that has room for at least nSize bytes */
+    void Get(CSerializeData& vchRet, size_t nSize);
+    /** Take vch back into the pool (or free it if the pool is full), leaves vch empty */
+    void Put(CSerializeData& vch);
+    size_t GetPooledBytes() const;
+
+private:
+    static const int SIZE_CLASSES = MAX_SIZE_BITS - MIN_SIZE_BITS + 1;
+
+    mutable CCriticalSection cs;
+    std::vector<CSerializeData> vFree[SIZE_CLASSES];
+    size_t nPooledBytes;
+    size_t nMaxPooledBytes;
+};
+
+CNetMessageBufferPool& GetNetMessageBufferPool();
+
 class CNetMessage {
 public:
+    /** At most this much of a payload is allocated before its bytes arrive */
+    static const unsigned int PREALLOC_MAX_SIZE = 256 * 1024;
+
     bool in_data;                   // parsing header (false) or data (true)
 
     CDataStream hdrbuf;             // partially received header
@@ -639,6 +737,8 @@ public:
         nTime = 0;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -654,6 +754,8 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+    /** Make room in vRecv for the next nBytes of the payload */
+    void PrepareData(unsigned int nBytes);
 };
 
 
@@ -719,6 +821,9 @@ public:
 
     std::atomic_bool fPauseRecv;
     std::atomic_bool fPauseSend;
+    // Set while a message handler thread works on this node, which keeps the
+    // node's messages in order when there are several of them
+    std::atomic_bool fProcessingMessages;
 protected:
 
     mapMsgCmdSize mapSendBytesPerMsgCmd;
@@ -807,6 +912,12 @@ public:
     }
 
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete);
+    /**
+     * Room for reading the socket straight into the payload of the message
+     * being received, if at least nMinSize bytes of it are still missing.
+     * Pass the bytes read into it on to ReceiveMsgBytes as usual.
+     */
+    bool GetRecvDataBuffer(char*& pchRet, unsigned int& nSizeRet, unsigned int nMinSize);
 
     void SetRecvVersion(int nVersionIn)
     {
@@ -28,6 +28,7 @@ public:
 
     virtual void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload);
     virtual void BlockChecked(const CBlock& block, const CValidationState& state);
+    virtual void NewPoWValidBlock(const CBlockIndex *pindex, const CBlock& block);
 };
 
 struct CNodeStateStats {
@@ -42,6 +43,12 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
 
+/**
+ * Whether a message is handled alongside other peers' messages instead of
+ * under the serial message processing lock. Its handler may take cs_main
+ * only briefly and never while holding another lock.
+ */
+bool IsParallelMessage(const std::string& strCommand);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom, CConnman& connman, std::atomic<bool>& interrupt);
 /**
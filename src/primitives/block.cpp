@@ -16,6 +16,10 @@
 
 uint256 CBlockHeader::GetHash() const
 {
+    static_assert(sizeof(vchHeaderCached) == 80, "the cached header must cover all the hashed fields");
+    if (!hashCached.IsNull() && memcmp(vchHeaderCached, BEGIN(nVersion), sizeof(vchHeaderCached)) == 0)
+        return hashCached;
+
     uint256 thash;
 
     lyra2z_hash(BEGIN(nVersion), BEGIN(thash));
@@ -23,6 +27,30 @@ uint256 CBlockHeader::GetHash() const
     return thash;
 }
 
+void CBlockHeader::SetCachedHash(const uint256& hash)
+{
+    hashCached = hash;
+    memcpy(vchHeaderCached, BEGIN(nVersion), sizeof(vchHeaderCached));
+}
+
+std::vector<uint256> GetBlockHeaderHashes(const std::vector<CBlockHeader>& headers)
+{
+    static const size_t HEADER_SIZE = 80;
+    static_assert(sizeof(uint256) == 32, "hashes must be stored back to back");
+
+    std::vector<uint256> vHashes(headers.size());
+    if (headers.empty())
+        return vHashes;
+
+    // lyra2z_hash_many() takes the serialized headers back to back
+    std::vector<char> vData(headers.size() * HEADER_SIZE);
+    for (size_t i = 0; i < headers.size(); i++)
+        memcpy(&vData[i * HEADER_SIZE], BEGIN(headers[i].nVersion), HEADER_SIZE);
+
+    lyra2z_hash_many(&vData[0], BEGIN(vHashes[0]), headers.size());
+    return vHashes;
+}
+
 std::string CBlock::ToString() const
 {
     std::stringstream s;
@@ -35,7 +63,7 @@ std::string CBlock::ToString() const
         vtx.size());
     for (unsigned int i = 0; i < vtx.size(); i++)
     {
-        s << "  " << vtx[i].ToString() << "\n";
+        s << "  " << vtx[i]->ToString() << "\n";
     }
     return s.str();
 }
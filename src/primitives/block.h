@@ -54,6 +54,7 @@ public:
         nTime = 0;
         nBits = 0;
         nNonce = 0;
+        hashCached.SetNull();
     }
 
     bool IsNull() const
@@ -63,18 +64,37 @@ public:
 
     uint256 GetHash() const;
 
+    /**
+     * Remember the hash of this header, when it is already known (e.g. from the
+     * block index), so that GetHash() does not need to run Lyra2Z. The cached
+     * hash is ignored as soon as any field of the header changes.
+     */
+    void SetCachedHash(const uint256& hash);
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
     }
+
+private:
+    // memory only
+    uint256 hashCached;
+    unsigned char vchHeaderCached[80]; // the header data hashCached belongs to
 };
 
+/**
+ * Compute the hashes of a batch of headers, e.g. those of a headers message.
+ * Gives the same results as calling GetHash() on each of them, but is faster
+ * as several headers are hashed at once (see lyra2z_hash_many()).
+ */
+std::vector<uint256> GetBlockHeaderHashes(const std::vector<CBlockHeader>& headers);
+
 
 class CBlock : public CBlockHeader
 {
 public:
     // network and disk
-    std::vector<CTransaction> vtx;
+    std::vector<CTransactionRef> vtx;
 
     // memory only
     mutable CTxOut txoutMasternode; // masternode payment
@@ -111,14 +131,8 @@ public:
 
     CBlockHeader GetBlockHeader() const
     {
-        CBlockHeader block;
-        block.nVersion       = nVersion;
-        block.hashPrevBlock  = hashPrevBlock;
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.nNonce         = nNonce;
-        return block;
+        // Copies the cached hash as well, if any
+        return *this;
     }
 
     std::string ToString() const;
@@ -339,6 +339,14 @@ struct CMutableTransaction
 
 };
 
+/**
+ * A transaction that is shared, rather than copied, between blocks, the
+ * mempool and relay. The transaction itself is immutable.
+ */
+typedef std::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef() { return std::make_shared<const CTransaction>(); }
+template <typename Tx> static inline CTransactionRef MakeTransactionRef(Tx&& txIn) { return std::make_shared<const CTransaction>(std::forward<Tx>(txIn)); }
+
 /** Implementation of BIP69
  * https://github.com/bitcoin/bips/blob/master/bip-0069.mediawiki
  */
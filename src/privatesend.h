@@ -217,20 +217,20 @@ private:
     int nConfirmedHeight;
 
 public:
-    CTransaction tx;
+    CTransactionRef tx;
     CTxIn vin;
     std::vector<unsigned char> vchSig;
     int64_t sigTime;
 
     CDarksendBroadcastTx() :
         nConfirmedHeight(-1),
-        tx(),
+        tx(MakeTransactionRef()),
         vin(),
         vchSig(),
         sigTime(0)
         {}
 
-    CDarksendBroadcastTx(CTransaction tx, COutPoint outpoint, int64_t sigTime) :
+    CDarksendBroadcastTx(const CTransactionRef& tx, COutPoint outpoint, int64_t sigTime) :
         nConfirmedHeight(-1),
         tx(tx),
         vin(CTxIn(outpoint)),
@@ -250,7 +250,7 @@ public:
 
     friend bool operator==(const CDarksendBroadcastTx& a, const CDarksendBroadcastTx& b)
     {
-        return a.tx == b.tx;
+        return *a.tx == *b.tx;
     }
     friend bool operator!=(const CDarksendBroadcastTx& a, const CDarksendBroadcastTx& b)
     {
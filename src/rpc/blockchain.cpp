@@ -106,8 +106,9 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("version", block.nVersion));
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
     UniValue txs(UniValue::VARR);
-    BOOST_FOREACH(const CTransaction&tx, block.vtx)
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx)
     {
+        const CTransaction& tx = *ptx;
         if(txDetails)
         {
             UniValue objTx(UniValue::VOBJ);
@@ -297,6 +298,8 @@ UniValue getblockhashes(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getblockhashes", "1231614698, 1231024505")
         );
 
+    EnsureIndexBuilt(INDEX_TIMESTAMP);
+
     unsigned int high = params[0].get_int();
     unsigned int low = params[1].get_int();
     std::vector<uint256> blockHashes;
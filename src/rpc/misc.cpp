@@ -7,6 +7,7 @@
 
 #include "base58.h"
 #include "clientversion.h"
+#include "indexer.h"
 #include "init.h"
 #include "net.h"
 #include "netbase.h"
@@ -532,6 +533,15 @@ UniValue setmocktime(const UniValue& params, bool fHelp)
     return NullUniValue;
 }
 
+void EnsureIndexBuilt(int nIndexes)
+{
+    int nHeight;
+    if (GetIndexesBuilding(&nHeight) & nIndexes)
+        throw JSONRPCError(RPC_IN_WARMUP, strprintf("Index is still being built (at height %d)", nHeight));
+    // Answer from an index that includes every block connected so far
+    SyncWithIndexer();
+}
+
 bool getAddressFromIndex(const int &type, const uint160 &hash, std::string &address)
 {
     if (type == 2) {
@@ -590,6 +600,141 @@ bool timestampSort(std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> a,
     return a.second.time < b.second.time;
 }
 
+/** Largest page of address history that one call returns */
+static const size_t MAX_ADDRESS_PAGE = 10000;
+
+/**
+ * A call pages through the history when it is given a "limit" or a "cursor";
+ * returns false for an old style call that gets everything at once.
+ */
+static bool getPageFromParams(const UniValue& params, size_t &nLimit, std::string &strCursor)
+{
+    if (!params[0].isObject())
+        return false;
+
+    UniValue limitValue = find_value(params[0].get_obj(), "limit");
+    UniValue cursorValue = find_value(params[0].get_obj(), "cursor");
+    if (limitValue.isNull() && cursorValue.isNull())
+        return false;
+
+    nLimit = MAX_ADDRESS_PAGE;
+    if (!limitValue.isNull()) {
+        int64_t nValue = limitValue.get_int64();
+        if (nValue < 1 || nValue > (int64_t)MAX_ADDRESS_PAGE)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Limit is expected to be between 1 and %u", MAX_ADDRESS_PAGE));
+        nLimit = nValue;
+    }
+    if (!cursorValue.isNull())
+        strCursor = cursorValue.get_str();
+
+    return true;
+}
+
+/** A cursor is the position of the address in the request and the index key the next page starts at */
+template <typename Key>
+static std::string encodeAddressCursor(unsigned int nAddress, const Key &key)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << nAddress << key;
+    return HexStr(ss.begin(), ss.end());
+}
+
+template <typename Key>
+static unsigned int decodeAddressCursor(const std::string &strCursor, const std::vector<std::pair<uint160, int> > &addresses, Key &key)
+{
+    if (!IsHex(strCursor))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+
+    std::vector<unsigned char> data(ParseHex(strCursor));
+    CDataStream ss(data, SER_DISK, CLIENT_VERSION);
+    unsigned int nAddress;
+    try {
+        ss >> nAddress >> key;
+    } catch (const std::exception&) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    }
+
+    // The cursor has to belong to the same list of addresses
+    if (!ss.empty() || nAddress >= addresses.size() ||
+        key.hashBytes != addresses[nAddress].first || key.type != (unsigned int)addresses[nAddress].second)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+
+    return nAddress;
+}
+
+static void getFirstAddressKey(const std::pair<uint160, int> &address, int start, CAddressIndexKey &key)
+{
+    key = CAddressIndexKey(address.second, address.first, start, 0, uint256(), 0, false);
+}
+
+static void getFirstAddressKey(const std::pair<uint160, int> &address, int start, CAddressUnspentKey &key)
+{
+    key = CAddressUnspentKey(address.second, address.first, uint256(), 0);
+}
+
+static bool getAddressPage(const CAddressIndexKey &keyStart, int end, size_t nLimit,
+                           std::vector<std::pair<CAddressIndexKey, CAmount> > &entries,
+                           bool &fMore, CAddressIndexKey &keyNext)
+{
+    return GetAddressIndex(keyStart, end, nLimit, entries, fMore, keyNext);
+}
+
+static bool getAddressPage(const CAddressUnspentKey &keyStart, int end, size_t nLimit,
+                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &entries,
+                           bool &fMore, CAddressUnspentKey &keyNext)
+{
+    return GetAddressUnspent(keyStart, nLimit, entries, fMore, keyNext);
+}
+
+/**
+ * Read one page of the index entries of the addresses, in the order the
+ * addresses were given and in index order for each address. Seeking to the
+ * key in the cursor means a page costs the same wherever it is in the history.
+ * Sets strCursorNext to where the next page starts, or clears it after the last page.
+ */
+template <typename Key, typename Value>
+static void getAddressHistoryPage(const std::vector<std::pair<uint160, int> > &addresses, const std::string &strCursor,
+                                  int start, int end, size_t nLimit,
+                                  std::vector<std::pair<Key, Value> > &entries, std::string &strCursorNext)
+{
+    unsigned int nAddress = 0;
+    Key key;
+    if (strCursor.empty())
+        getFirstAddressKey(addresses[0], start, key);
+    else
+        nAddress = decodeAddressCursor(strCursor, addresses, key);
+
+    strCursorNext.clear();
+    while (true) {
+        bool fMore = false;
+        Key keyNext;
+        if (!getAddressPage(key, end, nLimit - entries.size(), entries, fMore, keyNext)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        }
+        if (fMore) {
+            strCursorNext = encodeAddressCursor(nAddress, keyNext);
+            break;
+        }
+        if (++nAddress == addresses.size())
+            break;
+        getFirstAddressKey(addresses[nAddress], start, key);
+        if (entries.size() >= nLimit) {
+            strCursorNext = encodeAddressCursor(nAddress, key);
+            break;
+        }
+    }
+}
+
+/** Wrap a page of results together with the cursor of the next page, if there is one */
+static UniValue getAddressPageResult(const std::string &strName, const UniValue &page, const std::string &strCursorNext)
+{
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair(strName, page));
+    if (!strCursorNext.empty())
+        result.push_back(Pair("cursor", strCursorNext));
+    return result;
+}
+
 UniValue getaddressmempool(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -674,6 +819,8 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "      \"address\"  (string) The base58check encoded address\n"
             "      ,...\n"
             "    ]\n"
+            "  \"limit\" (number, optional) Return at most this many outputs and a cursor for the rest\n"
+            "  \"cursor\" (string, optional) Continue where the previous call stopped\n"
             "}\n"
             "\nResult\n"
             "[\n"
@@ -686,11 +833,19 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "    \"height\"  (number) The block height\n"
             "  }\n"
             "]\n"
+            "\nResult (with limit or cursor)\n"
+            "{\n"
+            "  \"utxos\"  (array) The outputs as above, address by address in index order rather than by height\n"
+            "  \"cursor\"  (string) Pass this in the next call for the next page; missing after the last page\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"NwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}'")
+            + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"NwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"], \"limit\": 1000}'")
             + HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"NwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}")
         );
 
+    EnsureIndexBuilt(INDEX_ADDRESS);
+
     std::vector<std::pair<uint160, int> > addresses;
 
     if (!getAddressesFromParams(params, addresses)) {
@@ -699,13 +854,21 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
 
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    size_t nLimit;
+    std::string strCursor, strCursorNext;
+    bool fPaged = getPageFromParams(params, nLimit, strCursor);
+
+    if (fPaged) {
+        getAddressHistoryPage(addresses, strCursor, 0, 0, nLimit, unspentOutputs, strCursorNext);
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
         }
-    }
 
-    std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
+        std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
+    }
 
     UniValue result(UniValue::VARR);
 
@@ -725,6 +888,9 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
         result.push_back(output);
     }
 
+    if (fPaged)
+        return getAddressPageResult("utxos", result, strCursorNext);
+
     return result;
 }
 
@@ -743,6 +909,8 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
+            "  \"limit\" (number, optional) Return about this many deltas and a cursor for the rest\n"
+            "  \"cursor\" (string, optional) Continue where the previous call stopped\n"
             "}\n"
             "\nResult:\n"
             "[\n"
@@ -755,11 +923,18 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "    \"address\"  (string) The base58check encoded address\n"
             "  }\n"
             "]\n"
+            "\nResult (with limit or cursor):\n"
+            "{\n"
+            "  \"deltas\"  (array) The deltas as above, address by address; a page never splits a transaction\n"
+            "  \"cursor\"  (string) Pass this in the next call for the next page; missing after the last page\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"NwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}'")
+            + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"NwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"], \"limit\": 1000}'")
             + HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"NwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}")
         );
 
+    EnsureIndexBuilt(INDEX_ADDRESS);
 
     UniValue startValue = find_value(params[0].get_obj(), "start");
     UniValue endValue = find_value(params[0].get_obj(), "end");
@@ -783,14 +958,26 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
 
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+    size_t nLimit;
+    std::string strCursor, strCursorNext;
+    bool fPaged = getPageFromParams(params, nLimit, strCursor);
+
+    if (fPaged) {
         if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
+            getAddressHistoryPage(addresses, strCursor, start, end, nLimit, addressIndex, strCursorNext);
         } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            getAddressHistoryPage(addresses, strCursor, 0, 0, nLimit, addressIndex, strCursorNext);
+        }
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (start > 0 && end > 0) {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
+            } else {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
             }
         }
     }
@@ -813,6 +1000,9 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         result.push_back(delta);
     }
 
+    if (fPaged)
+        return getAddressPageResult("deltas", result, strCursorNext);
+
     return result;
 }
 
@@ -834,39 +1024,60 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
             "{\n"
             "  \"balance\"  (string) The current balance in duffs\n"
             "  \"received\"  (string) The total number of duffs received (including change)\n"
+            "  \"txcount\"  (number) The number of transactions involving each address, added up\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"NwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}'")
             + HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"NwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}")
         );
 
+    // The balances may still be being built for an older address index
+    const bool fBalanceIndex = fAddressBalanceIndex;
+    EnsureIndexBuilt(INDEX_ADDRESS);
+
     std::vector<std::pair<uint160, int> > addresses;
 
     if (!getAddressesFromParams(params, addresses)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-        }
-    }
-
     CAmount balance = 0;
     CAmount received = 0;
+    int64_t txcount = 0;
 
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
-        if (it->second > 0) {
-            received += it->second;
+    if (fBalanceIndex) {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            CAddressBalance addressBalance;
+            if (!GetAddressBalance((*it).first, (*it).second, addressBalance)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
+            balance += addressBalance.balance;
+            received += addressBalance.received;
+            txcount += addressBalance.txCount;
+        }
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
+
+            std::set<uint256> txids;
+            for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator mi=addressIndex.begin(); mi!=addressIndex.end(); mi++) {
+                if (mi->second > 0) {
+                    received += mi->second;
+                }
+                balance += mi->second;
+                txids.insert(mi->first.txhash);
+            }
+            txcount += txids.size();
         }
-        balance += it->second;
     }
 
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("balance", balance));
     result.push_back(Pair("received", received));
+    result.push_back(Pair("txcount", txcount));
 
     return result;
 
@@ -887,17 +1098,27 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
+            "  \"limit\" (number, optional) Read about this many index entries and return a cursor for the rest\n"
+            "  \"cursor\" (string, optional) Continue where the previous call stopped\n"
             "}\n"
             "\nResult:\n"
             "[\n"
             "  \"transactionid\"  (string) The transaction id\n"
             "  ,...\n"
             "]\n"
+            "\nResult (with limit or cursor):\n"
+            "{\n"
+            "  \"txids\"  (array) The transaction ids, address by address in height order\n"
+            "  \"cursor\"  (string) Pass this in the next call for the next page; missing after the last page\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"NwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}'")
+            + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"NwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"], \"limit\": 1000}'")
             + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"NwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}")
         );
 
+    EnsureIndexBuilt(INDEX_ADDRESS);
+
     std::vector<std::pair<uint160, int> > addresses;
 
     if (!getAddressesFromParams(params, addresses)) {
@@ -917,14 +1138,26 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
 
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+    size_t nLimit;
+    std::string strCursor, strCursorNext;
+    bool fPaged = getPageFromParams(params, nLimit, strCursor);
+
+    if (fPaged) {
         if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
+            getAddressHistoryPage(addresses, strCursor, start, end, nLimit, addressIndex, strCursorNext);
         } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            getAddressHistoryPage(addresses, strCursor, 0, 0, nLimit, addressIndex, strCursorNext);
+        }
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (start > 0 && end > 0) {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
+            } else {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
             }
         }
     }
@@ -936,7 +1169,7 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         int height = it->first.blockHeight;
         std::string txid = it->first.txhash.GetHex();
 
-        if (addresses.size() > 1) {
+        if (addresses.size() > 1 && !fPaged) {
             txids.insert(std::make_pair(height, txid));
         } else {
             if (txids.insert(std::make_pair(height, txid)).second) {
@@ -945,12 +1178,15 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         }
     }
 
-    if (addresses.size() > 1) {
+    if (addresses.size() > 1 && !fPaged) {
         for (std::set<std::pair<int, std::string> >::const_iterator it=txids.begin(); it!=txids.end(); it++) {
             result.push_back(it->second);
         }
     }
 
+    if (fPaged)
+        return getAddressPageResult("txids", result, strCursorNext);
+
     return result;
 
 }
@@ -978,6 +1214,8 @@ UniValue getspentinfo(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getspentinfo", "{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}")
         );
 
+    EnsureIndexBuilt(INDEX_SPENT);
+
     UniValue txidValue = find_value(params[0].get_obj(), "txid");
     UniValue indexValue = find_value(params[0].get_obj(), "index");
 
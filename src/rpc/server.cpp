@@ -39,6 +39,10 @@ static std::vector<RPCTimerInterface*> timerInterfaces;
 /* Map of name to timer.
  * @note Can be changed to std::unique_ptr when C++11 */
 static std::map<std::string, boost::shared_ptr<RPCTimerBase> > deadlineTimers;
+/* Wake ups of deferred calls */
+static CWaitableCriticalSection cs_deferredWakes;
+static CConditionVariable cvDeferredWakes;
+static uint64_t nDeferredWakes = 0;
 
 static struct CRPCSignals
 {
@@ -46,6 +50,7 @@ static struct CRPCSignals
     boost::signals2::signal<void ()> Stopped;
     boost::signals2::signal<void (const CRPCCommand&)> PreCommand;
     boost::signals2::signal<void (const CRPCCommand&)> PostCommand;
+    boost::signals2::signal<void ()> WakeDeferred;
 } g_rpcSignals;
 
 void RPCServer::OnStarted(boost::function<void ()> slot)
@@ -68,6 +73,47 @@ void RPCServer::OnPostCommand(boost::function<void (const CRPCCommand&)> slot)
     g_rpcSignals.PostCommand.connect(boost::bind(slot, _1));
 }
 
+void RPCServer::OnWakeDeferred(boost::function<void ()> slot)
+{
+    g_rpcSignals.WakeDeferred.connect(slot);
+}
+
+uint64_t GetDeferredRPCWakes()
+{
+    boost::unique_lock<boost::mutex> lock(cs_deferredWakes);
+    return nDeferredWakes;
+}
+
+void WakeDeferredRPCs()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_deferredWakes);
+        nDeferredWakes++;
+        cvDeferredWakes.notify_all();
+    }
+    g_rpcSignals.WakeDeferred();
+}
+
+/** Wait for the answer of a deferred call in this thread, for callers that cannot park it */
+static UniValue WaitForDeferredRPC(JSONRPCDeferred deferred)
+{
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(cs_deferredWakes);
+            boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(deferred.nTimeout);
+            while (nDeferredWakes == deferred.nWakes) {
+                if (!cvDeferredWakes.timed_wait(lock, deadline))
+                    break;
+            }
+        }
+        try {
+            return deferred.fnResume();
+        } catch (const JSONRPCDeferred& next) {
+            deferred = next;
+        }
+    }
+}
+
 void RPCTypeCheck(const UniValue& params,
                   const list<UniValue::VType>& typesExpected,
                   bool fAllowNull)
@@ -441,6 +487,7 @@ void InterruptRPC()
     LogPrint("rpc", "Interrupting RPC\n");
     // Interrupt e.g. running longpolls
     fRPCRunning = false;
+    WakeDeferredRPCs();
 }
 
 void StopRPC()
@@ -539,7 +586,7 @@ std::string JSONRPCExecBatch(const UniValue& vReq)
     return ret.write() + "\n";
 }
 
-UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params) const
+UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params, bool fAllowDefer) const
 {
     // Return immediately if in warmup
     {
@@ -558,7 +605,13 @@ UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params
     try
     {
         // Execute
-        return pcmd->actor(params, false);
+        try {
+            return pcmd->actor(params, false);
+        } catch (const JSONRPCDeferred& deferred) {
+            if (fAllowDefer)
+                throw;
+            return WaitForDeferredRPC(deferred);
+        }
     }
     catch (const std::exception& e)
     {
@@ -27,6 +27,7 @@ namespace RPCServer
     void OnStopped(boost::function<void ()> slot);
     void OnPreCommand(boost::function<void (const CRPCCommand&)> slot);
     void OnPostCommand(boost::function<void (const CRPCCommand&)> slot);
+    void OnWakeDeferred(boost::function<void ()> slot);
 }
 
 class CBlockIndex;
@@ -43,6 +44,29 @@ public:
     void parse(const UniValue& valRequest);
 };
 
+/**
+ * Thrown by an RPC method that has no answer yet, like a long polling
+ * getblocktemplate. fnResume gets called again once WakeDeferredRPCs was
+ * called since the method read nWakes from GetDeferredRPCWakes(), or after
+ * nTimeout milliseconds; it returns the answer or throws the next
+ * JSONRPCDeferred.
+ */
+class JSONRPCDeferred
+{
+public:
+    uint64_t nWakes;
+    int64_t nTimeout;
+    boost::function<UniValue ()> fnResume;
+
+    JSONRPCDeferred(uint64_t nWakesIn, int64_t nTimeoutIn, const boost::function<UniValue ()>& fnResumeIn) :
+        nWakes(nWakesIn), nTimeout(nTimeoutIn), fnResume(fnResumeIn) {}
+};
+
+/** Number of times WakeDeferredRPCs was called, read it before checking whether to defer */
+uint64_t GetDeferredRPCWakes();
+/** Have the deferred RPC calls check again whether they can answer */
+void WakeDeferredRPCs();
+
 /** Query whether RPC is running */
 bool IsRPCRunning();
 
@@ -138,10 +162,11 @@ public:
      * Execute a method.
      * @param method   Method to execute
      * @param params   UniValue Array of arguments (JSON objects)
+     * @param fAllowDefer  Pass on JSONRPCDeferred to the caller instead of waiting for the answer
      * @returns Result of the call.
      * @throws an exception (UniValue) when an error happens.
      */
-    UniValue execute(const std::string &method, const UniValue &params) const;
+    UniValue execute(const std::string &method, const UniValue &params, bool fAllowDefer = false) const;
 
     /**
     * Returns a list of registered commands
@@ -170,6 +195,7 @@ extern std::string HelpExampleCli(const std::string& methodname, const std::stri
 extern std::string HelpExampleRpc(const std::string& methodname, const std::string& args);
 
 extern void EnsureWalletIsUnlocked();
+extern void EnsureIndexBuilt(int nIndexes); // in rpc/misc.cpp
 
 extern UniValue getconnectioncount(const UniValue& params, bool fHelp); // in rpc/net.cpp
 extern UniValue getaddressmempool(const UniValue& params, bool fHelp);
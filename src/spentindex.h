@@ -10,6 +10,9 @@
 #include "amount.h"
 #include "script/script.h"
 
+#include <utility>
+#include <vector>
+
 struct CSpentIndexKey {
     uint256 txid;
     unsigned int outputIndex;
@@ -369,5 +372,146 @@ struct CAddressIndexIteratorHeightKey {
     }
 };
 
+struct CAddressBalanceKey {
+    unsigned int type;
+    uint160 hashBytes;
+
+    size_t GetSerializeSize(int nType, int nVersion) const {
+        return 21;
+    }
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ser_writedata8(s, type);
+        hashBytes.Serialize(s, nType, nVersion);
+    }
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        type = ser_readdata8(s);
+        hashBytes.Unserialize(s, nType, nVersion);
+    }
+
+    CAddressBalanceKey(unsigned int addressType, uint160 addressHash) {
+        type = addressType;
+        hashBytes = addressHash;
+    }
+
+    CAddressBalanceKey() {
+        SetNull();
+    }
+
+    void SetNull() {
+        type = 0;
+        hashBytes.SetNull();
+    }
+
+    friend bool operator<(const CAddressBalanceKey& a, const CAddressBalanceKey& b) {
+        return a.type < b.type || (a.type == b.type && a.hashBytes < b.hashBytes);
+    }
+};
+
+/** Running totals of an address, or the change a block makes to them */
+struct CAddressBalance {
+    CAmount balance;
+    //! total of all outputs to the address, including change
+    CAmount received;
+    //! transactions that spend from or pay to the address
+    int64_t txCount;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(balance);
+        READWRITE(received);
+        READWRITE(txCount);
+    }
+
+    CAddressBalance(CAmount b, CAmount r, int64_t n) {
+        balance = b;
+        received = r;
+        txCount = n;
+    }
+
+    CAddressBalance() {
+        SetNull();
+    }
+
+    void SetNull() {
+        balance = 0;
+        received = 0;
+        txCount = 0;
+    }
+
+    bool IsNull() const {
+        return txCount == 0;
+    }
+};
+
+/** Address, unspent, spent, timestamp and balance index records of one or more blocks, in chain order */
+struct CIndexRecords {
+    //! address index entries, written when connecting and erased when disconnecting
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    //! unspent outputs to add or restore, a null value erases the entry
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    //! spending inputs to add, a null value erases the entry
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    std::vector<CTimestampIndexKey> timestampIndex;
+    //! changes to the address balances, added when connecting and subtracted when disconnecting
+    std::vector<std::pair<CAddressBalanceKey, CAddressBalance> > addressBalance;
+
+    size_t size() const {
+        return addressIndex.size() + addressUnspentIndex.size() + spentIndex.size() + timestampIndex.size() + addressBalance.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    void clear() {
+        addressIndex.clear();
+        addressUnspentIndex.clear();
+        spentIndex.clear();
+        timestampIndex.clear();
+        addressBalance.clear();
+    }
+};
+
+/** The optional indexes, as bits of CIndexBuildState::nIndexes */
+enum IndexFlags {
+    INDEX_ADDRESS = (1 << 0),
+    INDEX_SPENT = (1 << 1),
+    INDEX_TIMESTAMP = (1 << 2),
+    INDEX_ADDRESS_BALANCE = (1 << 3),
+};
+
+/** Progress of the background index builder, stored with each batch of records it writes */
+struct CIndexBuildState {
+    //! the indexes being built
+    int nIndexes;
+    //! the last block whose records have been written
+    uint256 hashBlock;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nIndexes);
+        READWRITE(hashBlock);
+    }
+
+    CIndexBuildState() {
+        SetNull();
+    }
+
+    CIndexBuildState(int nIndexesIn) {
+        nIndexes = nIndexesIn;
+        hashBlock.SetNull();
+    }
+
+    void SetNull() {
+        nIndexes = 0;
+        hashBlock.SetNull();
+    }
+};
 
 #endif // BITCOIN_SPENTINDEX_H
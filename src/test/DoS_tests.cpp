@@ -12,10 +12,12 @@
 #include "script/sign.h"
 #include "serialize.h"
 #include "util.h"
+#include "validation.h"
 
 #include "test/test_npscoin.h"
 
 #include <stdint.h>
+#include <thread>
 
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
 #include <boost/date_time/posix_time/posix_time_types.hpp>
@@ -23,11 +25,11 @@
 #include <boost/test/unit_test.hpp>
 
 // Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
+extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
 extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
@@ -125,13 +127,44 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!connman->IsBanned(addr));
 }
 
+BOOST_AUTO_TEST_CASE(DoS_misbehaving_without_cs_main)
+{
+    std::atomic<bool> interruptDummy(false);
+
+    connman->ClearBanned();
+    CAddress addr(ip(0xa0b0c001), NODE_NONE);
+    CNode dummyNode(id++, NODE_NETWORK, 0, INVALID_SOCKET, addr, "", true);
+    dummyNode.SetSendVersion(PROTOCOL_VERSION);
+    GetNodeSignals().InitializeNode(&dummyNode, *connman);
+    dummyNode.nVersion = 1;
+    dummyNode.fSuccessfullyConnected = true;
+
+    // A parallel message handler reports misbehavior while another thread
+    // holds cs_main, the ban happens once SendMessages gets to the node
+    {
+        LOCK(cs_main);
+        std::thread t(Misbehaving, dummyNode.GetId(), 100);
+        t.join();
+        CNodeStateStats stats;
+        BOOST_CHECK(GetNodeStateStats(dummyNode.GetId(), stats));
+        BOOST_CHECK_EQUAL(stats.nMisbehavior, 0);
+    }
+    SendMessages(&dummyNode, *connman, interruptDummy);
+    BOOST_CHECK(connman->IsBanned(addr));
+
+    BOOST_CHECK(IsParallelMessage(NetMsgType::MNPING));
+    BOOST_CHECK(IsParallelMessage(NetMsgType::TXLOCKVOTE));
+    BOOST_CHECK(!IsParallelMessage(NetMsgType::BLOCK));
+    BOOST_CHECK(!IsParallelMessage(NetMsgType::MNANNOUNCE));
+}
+
 CTransaction RandomOrphan()
 {
     std::map<uint256, COrphanTx>::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return *it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -153,7 +186,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(MakeTransactionRef(tx), i);
     }
 
     // ... and 50 that depend on other orphans:
@@ -170,7 +203,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(MakeTransactionRef(tx), i);
     }
 
     // This really-big orphan should be ignored:
@@ -194,7 +227,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!AddOrphanTx(MakeTransactionRef(tx), i));
     }
 
     // Test EraseOrphansFor:
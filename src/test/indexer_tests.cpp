@@ -0,0 +1,230 @@
+// Copyright (c) 2018 The NPSCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "chainparams.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "indexer.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "script/standard.h"
+#include "txdb.h"
+#include "undo.h"
+#include "validation.h"
+#include "test/test_npscoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(indexer_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(indexer_records)
+{
+    CKeyID keyid;
+    keyid.SetHex("1111111111111111111111111111111111111111");
+    CScriptID scriptid;
+    scriptid.SetHex("2222222222222222222222222222222222222222");
+
+    // A coinbase paying a key, and a transaction spending an earlier P2SH
+    // output to the same key and to an unindexed OP_RETURN output
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.push_back(CTxOut(50 * COIN, GetScriptForDestination(keyid)));
+
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(GetRandHash(), 3);
+    spend.vout.push_back(CTxOut(9 * COIN, GetScriptForDestination(keyid)));
+    spend.vout.push_back(CTxOut(0, CScript() << OP_RETURN));
+
+    CBlock block;
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+    block.vtx.push_back(MakeTransactionRef(spend));
+
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.push_back(Coin(CTxOut(10 * COIN, GetScriptForDestination(scriptid)), 7, false));
+
+    CBlockIndex index;
+    index.nHeight = 12;
+    index.nTime = 1500000000;
+    uint256 hash = block.GetHash();
+    index.phashBlock = &hash;
+
+    CIndexRecords records;
+    GetBlockIndexRecords(block, blockundo, &index, INDEX_ADDRESS | INDEX_SPENT | INDEX_TIMESTAMP, records);
+
+    // two received outputs and one spent P2SH output
+    BOOST_CHECK_EQUAL(records.addressIndex.size(), 3U);
+    BOOST_CHECK_EQUAL(records.addressUnspentIndex.size(), 3U);
+    BOOST_CHECK_EQUAL(records.spentIndex.size(), 1U);
+    BOOST_CHECK_EQUAL(records.timestampIndex.size(), 1U);
+    BOOST_CHECK(records.timestampIndex[0].blockHash == hash);
+
+    const CSpentIndexValue& spent = records.spentIndex[0].second;
+    BOOST_CHECK(records.spentIndex[0].first.txid == spend.vin[0].prevout.hash);
+    BOOST_CHECK(spent.txid == block.vtx[1]->GetHash());
+    BOOST_CHECK_EQUAL(spent.satoshis, 10 * COIN);
+    BOOST_CHECK_EQUAL(spent.addressType, 2);
+    BOOST_CHECK(spent.addressHash == uint160(scriptid));
+
+    int64_t nBalance = 0;
+    for (size_t i = 0; i < records.addressIndex.size(); i++)
+        nBalance += records.addressIndex[i].second;
+    BOOST_CHECK_EQUAL(nBalance, 49 * COIN);
+
+    // Undoing the block erases what was added and restores the spent output
+    CIndexRecords undo;
+    GetBlockIndexUndoRecords(block, blockundo, &index, INDEX_ADDRESS | INDEX_SPENT | INDEX_TIMESTAMP, undo);
+    BOOST_CHECK_EQUAL(undo.addressIndex.size(), 3U);
+    BOOST_CHECK_EQUAL(undo.spentIndex.size(), 1U);
+    BOOST_CHECK(undo.spentIndex[0].second.IsNull());
+    BOOST_CHECK(undo.timestampIndex.empty());
+
+    int nRestored = 0;
+    for (size_t i = 0; i < undo.addressUnspentIndex.size(); i++) {
+        const CAddressUnspentValue& value = undo.addressUnspentIndex[i].second;
+        if (value.IsNull())
+            continue;
+        nRestored++;
+        BOOST_CHECK_EQUAL(value.satoshis, 10 * COIN);
+        BOOST_CHECK_EQUAL(value.blockHeight, 7);
+    }
+    BOOST_CHECK_EQUAL(nRestored, 1);
+
+    // One balance change per address: the key got paid twice in two
+    // transactions, the script address was spent from once
+    records.clear();
+    GetBlockIndexRecords(block, blockundo, &index, INDEX_ADDRESS_BALANCE, records);
+    BOOST_CHECK_EQUAL(records.size(), 2U);
+    for (size_t i = 0; i < records.addressBalance.size(); i++) {
+        const CAddressBalance& change = records.addressBalance[i].second;
+        if (records.addressBalance[i].first.hashBytes == uint160(keyid)) {
+            BOOST_CHECK_EQUAL(change.balance, 59 * COIN);
+            BOOST_CHECK_EQUAL(change.received, 59 * COIN);
+            BOOST_CHECK_EQUAL(change.txCount, 2);
+        } else {
+            BOOST_CHECK_EQUAL(change.balance, -10 * COIN);
+            BOOST_CHECK_EQUAL(change.received, 0);
+            BOOST_CHECK_EQUAL(change.txCount, 1);
+        }
+    }
+
+    // Only the requested indexes are computed
+    records.clear();
+    GetBlockIndexRecords(block, blockundo, &index, INDEX_SPENT, records);
+    BOOST_CHECK_EQUAL(records.size(), 1U);
+}
+
+BOOST_FIXTURE_TEST_CASE(indexer_address_pages, TestingSetup)
+{
+    uint160 hashBytes;
+    hashBytes.SetHex("3333333333333333333333333333333333333333");
+    uint160 hashOther;
+    hashOther.SetHex("4444444444444444444444444444444444444444");
+
+    // Five transactions at heights 1..5, the third one with two entries,
+    // and an entry of another address right behind them
+    std::vector<std::pair<CAddressIndexKey, CAmount> > entries;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspent;
+    for (int i = 1; i <= 5; i++) {
+        uint256 txhash = GetRandHash();
+        entries.push_back(std::make_pair(CAddressIndexKey(1, hashBytes, i, 1, txhash, 0, false), i * COIN));
+        if (i == 3)
+            entries.push_back(std::make_pair(CAddressIndexKey(1, hashBytes, i, 1, txhash, 1, false), COIN));
+        unspent.push_back(std::make_pair(CAddressUnspentKey(1, hashBytes, txhash, 0), CAddressUnspentValue(i * COIN, CScript(), i)));
+    }
+    entries.push_back(std::make_pair(CAddressIndexKey(1, hashOther, 1, 1, GetRandHash(), 0, false), COIN));
+    BOOST_CHECK(pblocktree->WriteAddressIndex(entries));
+    BOOST_CHECK(pblocktree->UpdateAddressUnspentIndex(unspent));
+
+    // A page of three ends after the third transaction rather than inside it
+    std::vector<std::pair<CAddressIndexKey, CAmount> > page;
+    bool fMore;
+    CAddressIndexKey keyNext;
+    BOOST_CHECK(pblocktree->ReadAddressIndex(CAddressIndexKey(1, hashBytes, 0, 0, uint256(), 0, false), 0, 3, page, fMore, keyNext));
+    BOOST_CHECK_EQUAL(page.size(), 4U);
+    BOOST_CHECK(fMore);
+    BOOST_CHECK_EQUAL(keyNext.blockHeight, 4);
+
+    // and the next one stops at the end of the address
+    page.clear();
+    BOOST_CHECK(pblocktree->ReadAddressIndex(keyNext, 0, 3, page, fMore, keyNext));
+    BOOST_CHECK_EQUAL(page.size(), 2U);
+    BOOST_CHECK(!fMore);
+
+    // The end height stops the last page early
+    page.clear();
+    BOOST_CHECK(pblocktree->ReadAddressIndex(CAddressIndexKey(1, hashBytes, 2, 0, uint256(), 0, false), 3, 10, page, fMore, keyNext));
+    BOOST_CHECK_EQUAL(page.size(), 3U);
+    BOOST_CHECK(!fMore);
+
+    // Unspent outputs come in pages of exactly the limit, and all of them once
+    std::set<uint256> seen;
+    CAddressUnspentKey keyUnspent(1, hashBytes, uint256(), 0);
+    do {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > outputs;
+        BOOST_CHECK(pblocktree->ReadAddressUnspentIndex(keyUnspent, 2, outputs, fMore, keyUnspent));
+        BOOST_CHECK(outputs.size() == 2U || !fMore);
+        for (size_t i = 0; i < outputs.size(); i++)
+            BOOST_CHECK(seen.insert(outputs[i].first.txhash).second);
+    } while (fMore);
+    BOOST_CHECK_EQUAL(seen.size(), 5U);
+}
+
+BOOST_FIXTURE_TEST_CASE(indexer_follows_chain, TestChain100Setup)
+{
+    fAddressIndex = true;
+    fAddressBalanceIndex = true;
+    fTimestampIndex = true;
+    StartIndexer(threadGroup);
+
+    CKeyID keyid = coinbaseKey.GetPubKey().GetID();
+    CScript scriptPubKey = GetScriptForDestination(keyid);
+    std::vector<CMutableTransaction> noTxns;
+    CreateAndProcessBlock(noTxns, scriptPubKey);
+    CreateAndProcessBlock(noTxns, scriptPubKey);
+    SyncWithIndexer();
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    BOOST_CHECK(pblocktree->ReadAddressIndex(keyid, 1, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 2U);
+
+    CAddressBalance balance;
+    BOOST_CHECK(pblocktree->ReadAddressBalance(CAddressBalanceKey(1, keyid), balance));
+    BOOST_CHECK_EQUAL(balance.txCount, 2);
+    BOOST_CHECK_EQUAL(balance.balance, addressIndex[0].second + addressIndex[1].second);
+
+    std::vector<uint256> hashes;
+    BOOST_CHECK(pblocktree->ReadTimestampIndex(chainActive.Tip()->nTime + 1, chainActive.Tip()->nTime, hashes));
+    BOOST_CHECK(std::find(hashes.begin(), hashes.end(), chainActive.Tip()->GetBlockHash()) != hashes.end());
+
+    // Disconnecting the tip takes its records back out
+    CValidationState state;
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(InvalidateBlock(state, Params().GetConsensus(), chainActive.Tip()));
+    }
+    SyncWithIndexer();
+    addressIndex.clear();
+    BOOST_CHECK(pblocktree->ReadAddressIndex(keyid, 1, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 1U);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspent;
+    BOOST_CHECK(pblocktree->ReadAddressUnspentIndex(keyid, 1, unspent));
+    BOOST_CHECK_EQUAL(unspent.size(), 1U);
+
+    BOOST_CHECK(pblocktree->ReadAddressBalance(CAddressBalanceKey(1, keyid), balance));
+    BOOST_CHECK_EQUAL(balance.txCount, 1);
+    BOOST_CHECK_EQUAL(balance.balance, addressIndex[0].second);
+    BOOST_CHECK_EQUAL(balance.received, addressIndex[0].second);
+
+    StopIndexer();
+    fAddressIndex = false;
+    fAddressBalanceIndex = false;
+    fTimestampIndex = false;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,183 @@
+// Copyright (c) 2018 The NPSCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "crypto/Lyra2Z/Lyra2.h"
+#include "crypto/Lyra2Z/Lyra2Z.h"
+#include "crypto/Lyra2Z/sph_blake.h"
+#include "random.h"
+#include "streams.h"
+#include "uint256.h"
+#include "utilstrencodings.h"
+#include "version.h"
+#include "test/test_npscoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(lyra2z_tests, BasicTestingSetup)
+
+static uint256 Lyra2Z(const std::vector<unsigned char>& header)
+{
+    uint256 hash;
+    BOOST_REQUIRE_EQUAL(header.size(), 80U);
+    lyra2z_hash((const char*)&header[0], (char*)hash.begin());
+    return hash;
+}
+
+static std::vector<unsigned char> SerializeHeader(const CBlockHeader& header)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header;
+    return std::vector<unsigned char>(ss.begin(), ss.end());
+}
+
+BOOST_AUTO_TEST_CASE(lyra2z_vectors)
+{
+    std::vector<unsigned char> zeros(80, 0x00), ones(80, 0xff), counter(80), pattern(80);
+    for (int i = 0; i < 80; i++) {
+        counter[i] = i;
+        pattern[i] = i * 7 + 3;
+    }
+
+    for (int impl = 0; impl < LYRA2Z_IMPL_COUNT; impl++) {
+        if (!lyra2z_select_impl(impl)) {
+            BOOST_TEST_MESSAGE("Lyra2Z implementation " << impl << " is not supported, skipping");
+            continue;
+        }
+        BOOST_TEST_MESSAGE("Testing the '" << lyra2z_impl_name() << "' Lyra2Z implementation");
+
+        BOOST_CHECK_EQUAL(Lyra2Z(zeros).GetHex(), "7d94bea23fed84bcbf6e2b1cf0d1b607fedcda571f103ed778f6c62e26bf639b");
+        BOOST_CHECK_EQUAL(Lyra2Z(counter).GetHex(), "0b1cab5869826a2add7a6cd4a23153e67eb3d9ff4312600ecf273bfb5aed0d6b");
+        BOOST_CHECK_EQUAL(Lyra2Z(ones).GetHex(), "240ba7ad2ad5d5cf5dffac40ee001a7ab655f96ca87609f235c6cf3747602f67");
+        BOOST_CHECK_EQUAL(Lyra2Z(pattern).GetHex(), "003a482fd7328b86abe7695f892866259fdf6ef9b8d091c419db3cd062589921");
+
+        // The genesis blocks of all networks
+        const char* chains[] = {CBaseChainParams::MAIN.c_str(), CBaseChainParams::TESTNET.c_str(), CBaseChainParams::REGTEST.c_str()};
+        for (unsigned int i = 0; i < sizeof(chains) / sizeof(chains[0]); i++) {
+            const CChainParams& params = Params(chains[i]);
+            BOOST_CHECK(Lyra2Z(SerializeHeader(params.GenesisBlock())) == params.GetConsensus().hashGenesisBlock);
+        }
+    }
+
+    lyra2z_autodetect();
+}
+
+BOOST_AUTO_TEST_CASE(lyra2z_implementations_agree)
+{
+    std::vector<unsigned char> header(80);
+    // Deliberately misaligned and dirty caller-provided matrix
+    std::vector<unsigned char> scratch(LYRA2Z_MATRIX_SIZE + 16, 0xa5);
+    uint64_t* matrix = (uint64_t*)(&scratch[0] + 8);
+
+    for (int round = 0; round < 64; round++) {
+        for (unsigned int i = 0; i < header.size(); i++) {
+            header[i] = insecure_rand();
+        }
+
+        BOOST_REQUIRE(lyra2z_select_impl(LYRA2Z_IMPL_GENERIC));
+        uint256 expected = Lyra2Z(header);
+
+        // Reference: the generic, allocating Lyra2 entry point
+        uint256 blake, reference;
+        {
+            sph_blake256_context ctx;
+            sph_blake256_init(&ctx);
+            sph_blake256(&ctx, &header[0], header.size());
+            sph_blake256_close(&ctx, blake.begin());
+        }
+        BOOST_CHECK_EQUAL(LYRA2(reference.begin(), 32, blake.begin(), 32, blake.begin(), 32, LYRA2Z_TIME_COST, LYRA2Z_NROWS, LYRA2Z_NCOLS), 0);
+        BOOST_CHECK(reference == expected);
+
+        for (int impl = 0; impl < LYRA2Z_IMPL_COUNT; impl++) {
+            if (!lyra2z_select_impl(impl)) continue;
+            BOOST_CHECK(Lyra2Z(header) == expected);
+
+            uint256 hash;
+            lyra2z_hash_matrix((const char*)&header[0], (char*)hash.begin(), matrix);
+            BOOST_CHECK(hash == expected);
+        }
+    }
+
+    lyra2z_autodetect();
+}
+
+BOOST_AUTO_TEST_CASE(lyra2z_hash_many_agrees)
+{
+    // Enough headers to exercise both the 4-way lanes and the remainder
+    std::vector<CBlockHeader> headers(11);
+    for (unsigned int i = 0; i < headers.size(); i++) {
+        headers[i].nVersion = insecure_rand();
+        headers[i].hashPrevBlock = GetRandHash();
+        headers[i].hashMerkleRoot = GetRandHash();
+        headers[i].nTime = insecure_rand();
+        headers[i].nBits = insecure_rand();
+        headers[i].nNonce = insecure_rand();
+    }
+
+    for (int impl = 0; impl < LYRA2Z_IMPL_COUNT; impl++) {
+        if (!lyra2z_select_impl(impl)) continue;
+        for (size_t count = 0; count <= headers.size(); count++) {
+            std::vector<CBlockHeader> batch(headers.begin(), headers.begin() + count);
+            std::vector<uint256> hashes = GetBlockHeaderHashes(batch);
+            BOOST_REQUIRE_EQUAL(hashes.size(), count);
+            for (size_t i = 0; i < count; i++) {
+                BOOST_CHECK(hashes[i] == Lyra2Z(SerializeHeader(batch[i])));
+            }
+        }
+    }
+
+    lyra2z_autodetect();
+}
+
+BOOST_AUTO_TEST_CASE(lyra2z_hash_midstate_agrees)
+{
+    CBlockHeader header;
+    header.nVersion = insecure_rand();
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = insecure_rand();
+    header.nBits = insecure_rand();
+
+    lyra2z_midstate midstate;
+    lyra2z_midstate_init(&midstate, BEGIN(header.nVersion));
+    for (int i = 0; i < 8; i++) {
+        header.nNonce = insecure_rand();
+        if (i % 2) header.nTime = insecure_rand();
+        uint256 hash;
+        lyra2z_hash_midstate(&midstate, BEGIN(header.nVersion), BEGIN(hash));
+        BOOST_CHECK(hash == header.GetHash());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(lyra2z_cached_hash)
+{
+    CBlock block(Params(CBaseChainParams::MAIN).GenesisBlock());
+    const uint256 hash = block.GetHash();
+    const uint256 fake = GetRandHash();
+
+    // The cached hash is returned as is, also by copies of the header
+    block.SetCachedHash(fake);
+    BOOST_CHECK(block.GetHash() == fake);
+    BOOST_CHECK(block.GetBlockHeader().GetHash() == fake);
+    BOOST_CHECK(CBlock(block).GetHash() == fake);
+
+    // but not anymore once the header changes
+    block.nNonce++;
+    BOOST_CHECK(block.GetHash() != fake);
+    block.nNonce--;
+    BOOST_CHECK(block.GetHash() == fake);
+    block.hashMerkleRoot = GetRandHash();
+    BOOST_CHECK(block.GetHash() != fake);
+
+    // Deserializing replaces it
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << Params(CBaseChainParams::MAIN).GenesisBlock();
+    block.SetCachedHash(fake);
+    ss >> block;
+    BOOST_CHECK(block.GetHash() == hash);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
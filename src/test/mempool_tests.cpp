@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "streams.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -317,6 +318,64 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     CheckSort<3>(pool, sortedOrder);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    entry.hadNoDependencies = true;
+
+    /* lowest fee, but pays for its child */
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(0LL).FromTx(tx1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 2 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(10000LL).FromTx(tx2));
+
+    /* child of tx1 with the highest fee */
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_11;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx3.vout[0].nValue = 9 * COIN;
+    entry.hadNoDependencies = false;
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(100000LL).FromTx(tx3));
+
+    CTxMemPool::txiter it1 = pool.mapTx.find(tx1.GetHash());
+    CTxMemPool::txiter it3 = pool.mapTx.find(tx3.GetHash());
+    BOOST_CHECK_EQUAL(it1->GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(it3->GetSizeWithAncestors(), it1->GetTxSize() + it3->GetTxSize());
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 100000LL);
+    BOOST_CHECK_EQUAL(it3->GetSigOpCountWithAncestors(), 2U);
+
+    /* tx3 with its parent still pays the best ancestor feerate */
+    std::vector<std::string> sortedOrder;
+    sortedOrder.push_back(tx3.GetHash().ToString());
+    sortedOrder.push_back(tx2.GetHash().ToString());
+    sortedOrder.push_back(tx1.GetHash().ToString());
+    CheckSort<4>(pool, sortedOrder);
+
+    /* Prioritising the parent carries over to the child's package */
+    pool.PrioritiseTransaction(tx1.GetHash(), tx1.GetHash().ToString(), 0, 50000LL);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 150000LL);
+
+    /* Once the parent is mined, the child stands alone */
+    CTxMemPool::setEntries stage;
+    stage.insert(it1);
+    pool.RemoveStaged(stage, true);
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(it3->GetSizeWithAncestors(), it3->GetTxSize());
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 100000LL);
+}
+
 
 BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
@@ -443,7 +502,7 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5, &pool));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7, &pool));
 
-    std::vector<CTransaction> vtx;
+    std::vector<CTransactionRef> vtx;
     std::list<CTransaction> conflicts;
     SetMockTime(42);
     SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
@@ -473,4 +532,41 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolSharedTxTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].scriptSig = CScript() << OP_11;
+    mtx.vout.resize(1);
+    mtx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    mtx.vout[0].nValue = 10 * COIN;
+    CTransactionRef ptx = MakeTransactionRef(mtx);
+
+    pool.addUnchecked(ptx->GetHash(), entry.FromTx(ptx));
+    BOOST_CHECK(pool.get(ptx->GetHash()) == ptx);
+    BOOST_CHECK(!pool.get(uint256()));
+
+    // A block built from the mempool shares the same transaction object
+    CBlock block;
+    block.vtx.push_back(pool.get(ptx->GetHash()));
+    BOOST_CHECK(block.vtx[0] == ptx);
+
+    // ...and still round-trips through the wire format
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    CBlock block2;
+    ss >> block2;
+    BOOST_CHECK_EQUAL(block2.vtx.size(), 1U);
+    BOOST_CHECK(*block2.vtx[0] == *ptx);
+
+    // Once mined, the mempool drops its reference
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(block.vtx, 1, conflicts);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(ptx.use_count(), 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
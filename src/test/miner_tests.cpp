@@ -104,17 +104,17 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         CBlock *pblock = &pblocktemplate->block; // pointer for convenience
         pblock->nVersion = 1;
         pblock->nTime = chainActive.Tip()->GetMedianTimePast()+1;
-        CMutableTransaction txCoinbase(pblock->vtx[0]);
+        CMutableTransaction txCoinbase(*pblock->vtx[0]);
         txCoinbase.nVersion = 1;
         txCoinbase.vin[0].scriptSig = CScript();
         txCoinbase.vin[0].scriptSig.push_back(blockinfo[i].extranonce);
         txCoinbase.vin[0].scriptSig.push_back(chainActive.Height());
         txCoinbase.vout[0].scriptPubKey = CScript();
-        pblock->vtx[0] = CTransaction(txCoinbase);
+        pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
         if (txFirst.size() == 0)
             baseheight = chainActive.Height();
         if (txFirst.size() < 4)
-            txFirst.push_back(new CTransaction(pblock->vtx[0]));
+            txFirst.push_back(new CTransaction(*pblock->vtx[0]));
         pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
         pblock->nNonce = blockinfo[i].nonce;
         BOOST_CHECK(ProcessNewBlock(chainparams, pblock, true, NULL, NULL));
@@ -388,4 +388,31 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+BOOST_FIXTURE_TEST_CASE(GetBlockTemplate_cache, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    unsigned int nTransactionsUpdated;
+    boost::shared_ptr<const CBlockTemplate> pblocktemplate;
+    {
+        LOCK(cs_main);
+        pblocktemplate = GetBlockTemplate(chainparams, nTransactionsUpdated);
+        BOOST_CHECK(pblocktemplate->block.hashPrevBlock == chainActive.Tip()->GetBlockHash());
+        BOOST_CHECK_EQUAL(nTransactionsUpdated, mempool.GetTransactionsUpdated());
+
+        // Asking again hands out the same template
+        BOOST_CHECK(GetBlockTemplate(chainparams, nTransactionsUpdated) == pblocktemplate);
+    }
+
+    // A new tip gets a new template, the old one stays intact for its holders
+    std::vector<CMutableTransaction> noTxns;
+    CreateAndProcessBlock(noTxns, GetScriptForDestination(coinbaseKey.GetPubKey().GetID()));
+    {
+        LOCK(cs_main);
+        boost::shared_ptr<const CBlockTemplate> pblocktemplateNew = GetBlockTemplate(chainparams, nTransactionsUpdated);
+        BOOST_CHECK(pblocktemplateNew != pblocktemplate);
+        BOOST_CHECK(pblocktemplateNew->block.hashPrevBlock == chainActive.Tip()->GetBlockHash());
+        BOOST_CHECK(pblocktemplate->block.hashPrevBlock == chainActive.Tip()->pprev->GetBlockHash());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
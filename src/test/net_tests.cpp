@@ -174,4 +174,116 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(socketevents_mode_parse)
+{
+    SocketEventsMode mode;
+    BOOST_CHECK(ParseSocketEventsMode("select", mode));
+    BOOST_CHECK(mode == SOCKETEVENTS_SELECT);
+    BOOST_CHECK(!ParseSocketEventsMode("", mode));
+    BOOST_CHECK(!ParseSocketEventsMode("kqueue", mode));
+
+    // The default is always usable and round trips through its name
+    BOOST_CHECK(ParseSocketEventsMode(GetSocketEventsModeName(DEFAULT_SOCKETEVENTS), mode));
+    BOOST_CHECK(mode == DEFAULT_SOCKETEVENTS);
+#ifdef USE_EPOLL
+    BOOST_CHECK(ParseSocketEventsMode("epoll", mode));
+    BOOST_CHECK(mode == SOCKETEVENTS_EPOLL);
+    BOOST_CHECK_EQUAL(GetSupportedSocketEventsModes(), "select, poll, epoll");
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_recv_into_place)
+{
+    const unsigned int nPayloadSize = 1000000;
+    std::vector<char> vPayload(nPayloadSize);
+    for (unsigned int i = 0; i < nPayloadSize; i++)
+        vPayload[i] = (char)(i * 7 + i / 251);
+
+    CDataStream ssHeader(SER_NETWORK, INIT_PROTO_VERSION);
+    ssHeader << CMessageHeader(Params().MessageStart(), NetMsgType::BLOCK, nPayloadSize);
+    BOOST_CHECK_EQUAL(ssHeader.size(), (size_t)CMessageHeader::HEADER_SIZE);
+
+    CNetMessage msg(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+    BOOST_CHECK_EQUAL(msg.readHeader(&ssHeader[0], ssHeader.size()), (int)ssHeader.size());
+    BOOST_CHECK(msg.in_data);
+    BOOST_CHECK(msg.vRecv.empty());
+
+    // Alternate copied chunks with chunks written straight into the payload buffer
+    unsigned int nPos = 0;
+    bool fInPlace = false;
+    while (nPos < nPayloadSize) {
+        unsigned int nChunk = std::min(nPayloadSize - nPos, 50000u);
+        if (fInPlace) {
+            msg.PrepareData(nChunk);
+            BOOST_REQUIRE(msg.vRecv.size() >= nPos + nChunk);
+            char* pch = &msg.vRecv[nPos];
+            memcpy(pch, &vPayload[nPos], nChunk);
+            BOOST_CHECK_EQUAL(msg.readData(pch, nChunk), (int)nChunk);
+        } else {
+            BOOST_CHECK_EQUAL(msg.readData(&vPayload[nPos], nChunk), (int)nChunk);
+        }
+        nPos += nChunk;
+        fInPlace = !fInPlace;
+    }
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK_EQUAL(msg.vRecv.size(), nPayloadSize);
+    BOOST_CHECK(std::equal(vPayload.begin(), vPayload.end(), msg.vRecv.begin()));
+
+    // The same through a node, reading into the buffer GetRecvDataBuffer hands out
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(CService(ipv4Addr, 7777), NODE_NETWORK), "", true);
+    char* pch;
+    unsigned int nSize;
+    BOOST_CHECK(!node.GetRecvDataBuffer(pch, nSize, 1));
+    bool fComplete = false;
+    BOOST_CHECK(node.ReceiveMsgBytes(&ssHeader[0], ssHeader.size(), fComplete));
+    BOOST_CHECK(node.ReceiveMsgBytes(&vPayload[0], 1000, fComplete));
+    nPos = 1000;
+    while (node.GetRecvDataBuffer(pch, nSize, 0x10000)) {
+        BOOST_REQUIRE(nSize >= 0x10000);
+        unsigned int nChunk = std::min(nSize, nPayloadSize - nPos);
+        memcpy(pch, &vPayload[nPos], nChunk);
+        BOOST_CHECK(node.ReceiveMsgBytes(pch, nChunk, fComplete));
+        nPos += nChunk;
+    }
+    BOOST_CHECK(!fComplete);
+    BOOST_CHECK(nPayloadSize - nPos < 0x10000);
+    BOOST_CHECK(node.ReceiveMsgBytes(&vPayload[nPos], nPayloadSize - nPos, fComplete));
+    BOOST_CHECK(fComplete);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_buffer_pool)
+{
+    CNetMessageBufferPool pool(1024 * 1024);
+    CSerializeData vch;
+
+    pool.Get(vch, 3000);
+    BOOST_CHECK(vch.empty());
+    BOOST_CHECK(vch.capacity() >= 3000);
+    vch.resize(3000);
+    const char* pchFirst = vch.data();
+    pool.Put(vch);
+    BOOST_CHECK(vch.empty());
+    BOOST_CHECK(pool.GetPooledBytes() >= 3000);
+
+    // Same size class comes back out of the pool, cleared
+    pool.Get(vch, 2500);
+    BOOST_CHECK(vch.data() == pchFirst);
+    BOOST_CHECK(vch.empty());
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), 0U);
+
+    // Nothing pooled beyond the limit
+    CSerializeData vchLarge;
+    pool.Get(vchLarge, 2 * 1024 * 1024);
+    pool.Put(vchLarge);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), 0U);
+    pool.Put(vch);
+
+    // Tiny buffers aren't worth keeping
+    CSerializeData vchTiny(10);
+    pool.Put(vchTiny);
+    BOOST_CHECK(pool.GetPooledBytes() <= 4096);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
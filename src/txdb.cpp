@@ -26,12 +26,15 @@ static const char DB_ADDRESSINDEX = 'a';
 static const char DB_ADDRESSUNSPENTINDEX = 'u';
 static const char DB_TIMESTAMPINDEX = 's';
 static const char DB_SPENTINDEX = 'p';
+static const char DB_ADDRESSBALANCE = 'A';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_INDEX_BUILD_STATE = 'I';
+static const char DB_INDEX_BEST_BLOCK = 'i';
 
 namespace {
 
@@ -260,6 +263,40 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
     return true;
 }
 
+bool CBlockTreeDB::ReadAddressUnspentIndex(const CAddressUnspentKey &keyStart, size_t nLimit,
+                                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                                           bool &fMore, CAddressUnspentKey &keyNext) {
+
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, keyStart));
+
+    size_t nRead = 0;
+    fMore = false;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressUnspentKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSUNSPENTINDEX ||
+            key.second.hashBytes != keyStart.hashBytes || key.second.type != keyStart.type) {
+            break;
+        }
+        if (nRead >= nLimit) {
+            fMore = true;
+            keyNext = key.second;
+            break;
+        }
+        CAddressUnspentValue nValue;
+        if (!pcursor->GetValue(nValue)) {
+            return error("failed to get address unspent value");
+        }
+        unspentOutputs.push_back(make_pair(key.second, nValue));
+        nRead++;
+        pcursor->Next();
+    }
+
+    return true;
+}
+
 bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
@@ -308,12 +345,117 @@ bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
     return true;
 }
 
+bool CBlockTreeDB::ReadAddressIndex(const CAddressIndexKey &keyStart, int end, size_t nLimit,
+                                    std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                                    bool &fMore, CAddressIndexKey &keyNext) {
+
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    pcursor->Seek(make_pair(DB_ADDRESSINDEX, keyStart));
+
+    size_t nRead = 0;
+    fMore = false;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressIndexKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSINDEX ||
+            key.second.hashBytes != keyStart.hashBytes || key.second.type != keyStart.type) {
+            break;
+        }
+        if (end > 0 && key.second.blockHeight > end) {
+            break;
+        }
+        // The page is full, but the entries of one transaction stay together
+        // so that a txid is never reported on two pages
+        if (nRead >= nLimit && key.second.txhash != addressIndex.back().first.txhash) {
+            fMore = true;
+            keyNext = key.second;
+            break;
+        }
+        CAmount nValue;
+        if (!pcursor->GetValue(nValue)) {
+            return error("failed to get address index value");
+        }
+        addressIndex.push_back(make_pair(key.second, nValue));
+        nRead++;
+        pcursor->Next();
+    }
+
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressBalance(const CAddressBalanceKey &key, CAddressBalance &value) {
+    // An address that was never used has no entry
+    value.SetNull();
+    Read(make_pair(DB_ADDRESSBALANCE, key), value);
+    return true;
+}
+
 bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
     CDBBatch batch(*this);
     batch.Write(make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::WriteIndexRecords(const CIndexRecords &records, bool fDisconnect, const CIndexBuildState &state, bool fBuilder) {
+    CDBBatch batch(*this);
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=records.addressIndex.begin(); it!=records.addressIndex.end(); it++) {
+        if (fDisconnect) {
+            batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
+        } else {
+            batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
+        }
+    }
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=records.addressUnspentIndex.begin(); it!=records.addressUnspentIndex.end(); it++) {
+        if (it->second.IsNull()) {
+            batch.Erase(make_pair(DB_ADDRESSUNSPENTINDEX, it->first));
+        } else {
+            batch.Write(make_pair(DB_ADDRESSUNSPENTINDEX, it->first), it->second);
+        }
+    }
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it=records.spentIndex.begin(); it!=records.spentIndex.end(); it++) {
+        if (it->second.IsNull()) {
+            batch.Erase(make_pair(DB_SPENTINDEX, it->first));
+        } else {
+            batch.Write(make_pair(DB_SPENTINDEX, it->first), it->second);
+        }
+    }
+    for (std::vector<CTimestampIndexKey>::const_iterator it=records.timestampIndex.begin(); it!=records.timestampIndex.end(); it++)
+        batch.Write(make_pair(DB_TIMESTAMPINDEX, *it), 0);
+    // Sum up the changes of each address first, there is one read per address and batch
+    std::map<CAddressBalanceKey, CAddressBalance> mapBalance;
+    for (std::vector<std::pair<CAddressBalanceKey, CAddressBalance> >::const_iterator it=records.addressBalance.begin(); it!=records.addressBalance.end(); it++) {
+        std::map<CAddressBalanceKey, CAddressBalance>::iterator mi = mapBalance.find(it->first);
+        if (mi == mapBalance.end()) {
+            // an address without an entry starts from zero
+            mi = mapBalance.insert(std::make_pair(it->first, CAddressBalance())).first;
+            Read(make_pair(DB_ADDRESSBALANCE, it->first), mi->second);
+        }
+        const int nSign = fDisconnect ? -1 : 1;
+        mi->second.balance += nSign * it->second.balance;
+        mi->second.received += nSign * it->second.received;
+        mi->second.txCount += nSign * it->second.txCount;
+    }
+    for (std::map<CAddressBalanceKey, CAddressBalance>::const_iterator it=mapBalance.begin(); it!=mapBalance.end(); it++) {
+        if (it->second.IsNull()) {
+            batch.Erase(make_pair(DB_ADDRESSBALANCE, it->first));
+        } else {
+            batch.Write(make_pair(DB_ADDRESSBALANCE, it->first), it->second);
+        }
+    }
+    // The progress marker goes in the same batch, so it never gets ahead of the records
+    batch.Write(fBuilder ? DB_INDEX_BUILD_STATE : DB_INDEX_BEST_BLOCK, state);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadIndexBuildState(CIndexBuildState &state, bool fBuilder) {
+    return Read(fBuilder ? DB_INDEX_BUILD_STATE : DB_INDEX_BEST_BLOCK, state);
+}
+
+bool CBlockTreeDB::EraseIndexBuildState(bool fBuilder) {
+    return Erase(fBuilder ? DB_INDEX_BUILD_STATE : DB_INDEX_BEST_BLOCK);
+}
+
 bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &hashes) {
 
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
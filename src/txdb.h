@@ -128,12 +128,25 @@ public:
     bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect);
     bool ReadAddressUnspentIndex(uint160 addressHash, int type,
                                  std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+    //! Read at most nLimit outputs of keyStart's address, starting at keyStart; fMore and keyNext tell where the next page starts
+    bool ReadAddressUnspentIndex(const CAddressUnspentKey &keyStart, size_t nLimit,
+                                 std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect,
+                                 bool &fMore, CAddressUnspentKey &keyNext);
     bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool ReadAddressIndex(uint160 addressHash, int type,
                           std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
                           int start = 0, int end = 0);
+    //! As above, but a page of about nLimit entries that starts at keyStart and never splits a transaction
+    bool ReadAddressIndex(const CAddressIndexKey &keyStart, int end, size_t nLimit,
+                          std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                          bool &fMore, CAddressIndexKey &keyNext);
+    bool ReadAddressBalance(const CAddressBalanceKey &key, CAddressBalance &value);
     bool WriteTimestampIndex(const CTimestampIndexKey &timestampIndex);
+    //! The state is either the index builder's progress (fBuilder) or the best block of the live indexes
+    bool WriteIndexRecords(const CIndexRecords &records, bool fDisconnect, const CIndexBuildState &state, bool fBuilder = true);
+    bool ReadIndexBuildState(CIndexBuildState &state, bool fBuilder = true);
+    bool EraseIndexBuildState(bool fBuilder = true);
     bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &vect);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);